@@ -15,6 +15,9 @@
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
+#include <cstdarg>
+#include <cmath>
+#include <climits>
 #include <dirent.h>
 #include <errno.h>
 #include <iostream>
@@ -22,12 +25,32 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <linux/fs.h>
 #include <unistd.h>
 #include <map>
 #include <list>
 #include <string>
 #include <fcntl.h>
 #include <time.h>
+#include <pwd.h>
+#include <grp.h>
+#include <pthread.h>
+#include <atomic>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #define STR_MYEXIT "myexit"
 
@@ -43,6 +66,65 @@
 #define READ_END  0
 #define WRITE_END 1
 
+#define WALK_BUFSIZE (64 * 1024)
+
+#define NLS_SORT_NAME 0
+#define NLS_SORT_SIZE 1
+#define NLS_SORT_TIME 2
+#define NLS_SORT_EXT  3
+#define NLS_SORT_NONE 4
+
+#define NLS_STREAM_BUFSIZE (1024 * 1024)
+
+#define NLS_CACHE_DIRS    64
+#define NLS_CACHE_ENTRIES (1024 * 1024)
+#define NLS_CACHE_EVENTS  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+#define INODE_SET_SHARDS  64
+
+#define FORWEB_MANIFEST_MAGIC "hfshfwm1"
+
+#define FORWEB_FD_DEPTH 128
+
+#define FORWEB_WATCH_BUDGET 8192
+#define FORWEB_WATCH_SETTLE 100
+#define FORWEB_WATCH_DELAY  1000
+#define FORWEB_WATCH_EVENTS (IN_CREATE | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+#define PROGRESS_INTERVAL_MS 250
+
+#define GLOB_LITERAL 0
+#define GLOB_ANY     1
+#define GLOB_STAR    2
+#define GLOB_CLASS   3
+
+#define GLOB_EXACT    0
+#define GLOB_PREFIX   1
+#define GLOB_SUFFIX   2
+#define GLOB_CONTAINS 3
+#define GLOB_GENERAL  4
+
+#define FIND_NAME  0
+#define FIND_TYPE  1
+#define FIND_SIZE  2
+#define FIND_MTIME 3
+#define FIND_NEWER 4
+#define FIND_MATCH 5
+
+#define FIND_OUT_FLUSH (64 * 1024)
+
+#define MYDU_TOP 10
+
+#define CP_CLONE 0
+#define CP_RANGE 1
+#define CP_SEND  2
+#define CP_READ  3
+
+#define CP_CHUNK (1 << 30)
+
+#define STAT_RING_ENTRIES 256
+#define STAT_RING_MIN     8
+
 //*********************************************************
 //
 // Structure Declarations
@@ -57,9 +139,428 @@ struct job_t {
 };
 
 struct fs_elem {
-    char *name;
-    char *color;
-} element;
+    std::string name;
+    unsigned char type;
+    const char *color;
+    mode_t mode;
+    nlink_t nlink;
+    uid_t uid;
+    gid_t gid;
+    off_t size;
+    struct timespec mtime;
+    std::string link;
+};
+
+// The colours nls uses, by file type and by extension. They start as
+// hfsh's own and are overridden by $LS_COLORS. Extensions are found
+// through a perfect hash: a bucket's displacement picks the one slot
+// that can hold the extension, so a lookup probes a single slot.
+struct color_table {
+    const char *dir, *link, *exec, *file, *fifo, *sock, *blk, *chr;
+    std::vector<uint32_t> disp;
+    std::vector<const char *> ext_keys;
+    std::vector<const char *> ext_colors;
+    std::list<std::string> strings;
+};
+
+// Output gathered in memory to be written with one system call. Colour
+// escapes are only emitted when the colour actually changes.
+struct out_buf {
+    std::string text;
+    const char *color = NULL;
+};
+
+// Entries are sorted as (key, index) pairs: the key holds as much of the
+// ordering as fits in 64 bits, so full records are only touched on ties
+struct sort_key {
+    uint64_t key;
+    uint32_t index;
+};
+
+// A directory queued on a parallel walk. Children are opened relative
+// to the parent's fd, which is closed once every child has opened its
+// own. On a walk with keep_parents set, the directory itself is kept
+// until its whole subtree is done: pending counts its own visit and
+// each child not yet done, and count is the leave callback's to total
+// with. Only with keep_fds does its fd stay open that long as well.
+struct walk_dir {
+    struct walk_dir *parent;
+    std::string name;
+    int depth;
+    int fd;
+    int error;
+    std::atomic<int> fd_refs;
+    std::atomic<long> pending;
+    std::atomic<long> count;
+    void *data;
+};
+
+struct walk_ctx;
+
+// One thread of a parallel walk, with its own deque and getdents buffer
+struct walk_worker {
+    struct walk_ctx *ctx;
+    int id;
+    std::mutex lock;
+    std::deque<walk_dir *> tasks;
+    alignas(struct dirent64) char buf[WALK_BUFSIZE];
+};
+
+typedef void walk_visit_t(struct walk_worker *worker, struct walk_dir *dir);
+
+// A parallel walk. With keep_parents set, each directory keeps its
+// parent pointer, so walk_path can name any directory in full: with
+// several threads, a leaf name alone doesn't say which directory an
+// error is about. A leave callback implies it. keep_fds is for a leave
+// callback that needs the fds; without it they are let go level by
+// level, so however deep the tree, few are open at once.
+struct walk_ctx {
+    walk_visit_t *visit;
+    walk_visit_t *leave = NULL;
+    bool keep_parents = false;
+    bool keep_fds = false;
+    void *arg;
+    std::vector<walk_worker *> workers;
+    std::vector<std::thread> threads;
+    std::atomic<long> outstanding;
+    std::atomic<long> queued;
+    std::atomic<int> sleepers;
+    std::mutex idle_lock;
+    std::condition_variable idle_cv;
+};
+
+// Reads entries from a directory fd with getdents64
+struct dent_reader {
+    int fd;
+    char *buf;
+    size_t len;
+    long nread;
+    long pos;
+};
+
+// An io_uring used to stat a whole getdents batch with one system call.
+// Each thread sets up its own the first time it is needed.
+struct stat_ring {
+    int fd = -1;
+    bool failed = false;
+    unsigned int entries;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes = NULL;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr = NULL;
+    void *cq_ptr = NULL;
+    size_t sq_len, cq_len, sqes_len;
+
+    ~stat_ring();
+};
+
+struct nls_opts {
+    bool recursive;
+    int sort;
+    bool reverse;
+    int width;
+    bool long_format;
+    int stream_passes;
+    bool summary;
+};
+
+// The entries of one directory, split into folders and files, each with
+// the order to print them in
+struct nls_contents {
+    std::vector<fs_elem> folders;
+    std::vector<fs_elem> files;
+    std::vector<sort_key> folder_order;
+    std::vector<sort_key> file_order;
+};
+
+// A directory listing kept between nls calls, keyed by the directory's
+// inode and dropped as soon as its inotify watch reports a change
+struct nls_cache_entry {
+    dev_t dev;
+    ino_t ino;
+    int wd;
+    std::vector<fs_elem> folders;
+    std::vector<fs_elem> files;
+};
+
+// The listing of one directory under nls -R, held until it is its turn to print
+struct nls_listing {
+    std::string path;
+    std::string text;
+    int error;
+    bool done;
+    std::vector<nls_listing *> children;
+};
+
+struct nls_tree {
+    struct nls_opts *opts;
+    std::mutex lock;
+    std::condition_variable cv;
+};
+
+// Totals for one nls -s directory, added to by every walker thread
+struct nls_summary {
+    std::string path;
+    int error;
+    std::atomic<unsigned long> failures;
+    std::atomic<unsigned long> files;
+    std::atomic<unsigned long> dirs;
+    std::atomic<unsigned long long> apparent;
+    std::atomic<unsigned long long> allocated;
+};
+
+// A set of (dev, ino) pairs, split into shards with their own locks so
+// walker threads rarely wait on each other
+struct dev_ino {
+    dev_t dev;
+    ino_t ino;
+
+    bool operator==(const dev_ino &other) const {
+        return dev == other.dev && ino == other.ino;
+    }
+};
+
+struct dev_ino_hash {
+    size_t operator()(const dev_ino &key) const {
+        return std::hash<unsigned long long>()(key.ino * 0x9E3779B97F4A7C15ULL ^ key.dev);
+    }
+};
+
+struct inode_set {
+    std::mutex locks[INODE_SET_SHARDS];
+    std::unordered_set<dev_ino, dev_ino_hash> shards[INODE_SET_SHARDS];
+};
+
+struct forweb_opts {
+    int threads;
+    char *manifest;
+    bool watch;
+    int budget;
+    bool xdev;
+    bool dry_run;
+};
+
+// The ctime each directory had when forweb last went through it, keyed by
+// (dev, ino) and sharded like inode_set. On disk it is a magic string
+// followed by one forweb_manifest_record per directory.
+struct forweb_manifest {
+    std::mutex locks[INODE_SET_SHARDS];
+    std::unordered_map<dev_ino, struct timespec, dev_ino_hash> shards[INODE_SET_SHARDS];
+};
+
+struct forweb_manifest_record {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+};
+
+// Totals for a forweb run, added to by every walker thread. With a
+// manifest, old is what the last run saw and next is what this one sees.
+// seen holds every directory entered and every file with several links.
+struct forweb_run {
+    std::string path;
+    int error;
+    bool xdev;
+    dev_t dev;
+    struct inode_set *seen;
+    std::atomic<unsigned long> entries;
+    std::atomic<unsigned long> modified;
+    std::atomic<unsigned long> failures;
+    std::atomic<unsigned long> unchanged;
+    std::atomic<unsigned long> duplicates;
+    std::atomic<unsigned long> crossings;
+    bool dry_run;
+    bool timed;
+    std::atomic<unsigned long> changes[2][07777 + 1];
+    std::atomic<unsigned long long> getdents_ns;
+    std::atomic<unsigned long long> stat_ns;
+    std::atomic<unsigned long long> chmod_ns;
+    time_t started;
+    struct forweb_manifest *old;
+    struct forweb_manifest *next;
+    struct forweb_watch *watch;
+};
+
+// What one directory added to a forweb run, kept apart until the
+// directory is done so the shared totals are only touched once
+struct forweb_tally {
+    unsigned long entries;
+    unsigned long modified;
+    unsigned long long getdents_ns;
+    unsigned long long stat_ns;
+    unsigned long long chmod_ns;
+};
+
+// The inotify watches of forweb --watch, each with the path it was added
+// for, and the entries events have named since they were last dealt with
+struct forweb_watch {
+    int fd;
+    int budget;
+    unsigned long unwatched;
+    bool overflow;
+    std::unordered_map<int, std::string> paths;
+    std::map<std::pair<int, std::string>, uint32_t> pending;
+};
+
+// One step of a compiled glob: a run of literal text, ? for any one
+// character, * for any run of them, or a [...] class as a 256-bit set
+struct glob_op {
+    int kind;
+    std::string text;
+    uint64_t set[4];
+};
+
+// A glob compiled once and matched against many names. Patterns that are
+// only literal text around at most two stars are matched as a plain
+// comparison against literal; the rest step through ops.
+struct glob_pattern {
+    int shape;
+    std::string literal;
+    std::vector<glob_op> ops;
+};
+
+// What prunedir deletes. Without any filter that is the empty files;
+// once one is given, the regular files that pass all of them.
+struct prune_opts {
+    int threads;
+    bool rmdirs;
+    bool dry_run;
+    char *log;
+    bool filtered;
+    time_t older;
+    long long larger;
+    long long smaller;
+    std::vector<glob_pattern> include;
+    std::vector<glob_pattern> exclude;
+};
+
+// Totals for a prunedir run, added to by every walker thread
+struct prune_run {
+    struct prune_opts *opts;
+    int error;
+    int log_fd;
+    std::atomic<unsigned long> entries;
+    std::atomic<unsigned long> deleted;
+    std::atomic<unsigned long long> bytes;
+    std::atomic<unsigned long> removed;
+    std::atomic<unsigned long> failures;
+};
+
+// One instruction of a compiled myfind expression. A test goes on to the
+// next instruction when it holds (after negate) and jumps to fail when it
+// doesn't; FIND_MATCH ends the program with a match. For -size and -mtime,
+// cmp is -1, 0 or 1 for -N, N and +N, counted in units of unit.
+struct find_op {
+    int code;
+    bool negate;
+    int fail;
+    int cmp;
+    long long n;
+    long long unit;
+    mode_t mode;
+    unsigned char d_type;
+    struct glob_pattern glob;
+    struct timespec time;
+};
+
+struct find_opts {
+    int threads;
+    std::list<char *> roots;
+    std::vector<find_op> program;
+    time_t now;
+};
+
+// An entry as myfind tests it: stat-ed only once a test needs more than
+// its name and d_type
+struct find_entry {
+    int dir_fd;
+    const char *name;
+    unsigned char d_type;
+    bool stated;
+    bool stat_failed;
+    struct stat file_stat;
+};
+
+struct find_run {
+    struct find_opts *opts;
+    std::atomic<unsigned long> failures;
+};
+
+struct du_opts {
+    int threads;
+    int top;
+    bool human;
+    std::list<char *> roots;
+};
+
+// One directory given to mydu, with the total of its whole tree
+struct du_root {
+    std::string path;
+    int error;
+    unsigned long long total;
+};
+
+// The largest subtrees one walker thread has seen, as a min-heap of at most
+// opts->top (size, path) pairs so the smallest is the one to give way
+typedef std::vector<std::pair<unsigned long long, std::string> > du_heap;
+
+// A mydu run. Each walk_dir's count is the space used under it so far:
+// its visit adds its own entries, and each finished subdirectory adds its
+// count on leaving. seen holds the files with several hard links.
+struct du_run {
+    struct du_opts *opts;
+    struct inode_set *seen;
+    std::vector<du_heap> heaps;
+    std::atomic<unsigned long> failures;
+};
+
+struct cp_opts {
+    int threads;
+    bool recursive;
+    char *source;
+    char *target;
+};
+
+// A copy run. clone and range are cleared the first time the target
+// filesystem turns down FICLONE or copy_file_range, so no other file tries
+// them. bytes counts what each of FICLONE, copy_file_range and sendfile
+// copied.
+struct cp_run {
+    std::atomic<bool> clone;
+    std::atomic<bool> range;
+    dev_t target_dev;
+    ino_t target_ino;
+    std::atomic<unsigned long> files;
+    std::atomic<unsigned long> dirs;
+    std::atomic<unsigned long long> bytes[4];
+    std::atomic<unsigned long> failures;
+};
+
+// The copy of a directory being made, kept open until everything under
+// it is copied and then given the mode of the original
+struct cp_dir {
+    int fd;
+    mode_t mode;
+};
+
+// Progress of the builtin running in the foreground. Its workers add to
+// entries as they go, and with --progress a ticker thread prints a line to
+// the terminal at most every PROGRESS_INTERVAL_MS. expected is what the last
+// walk of the same tree came to, for an estimate of the time left.
+struct progress {
+    const char *name;
+    bool show;
+    std::atomic<unsigned long> entries;
+    unsigned long expected;
+    std::string key;
+    struct timespec start;
+    bool done;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::thread ticker;
+};
 
 struct piped {
     char *file_in;
@@ -127,20 +628,164 @@ void update_history(char **toks);
 
 // Functions related to forweb
 int forweb(char *argv[]);
-int forweb_worker(char *dir_name);
+int parse_forweb_opts(char *argv[], struct forweb_opts *opts, char **dir_name);
+int forweb_worker(int dir_fd, int depth, string *path, struct forweb_run *run, char *buf, size_t buf_len, int *up_fd);
+void forweb_up(int dir_fd, string *path, int *up_fd);
+bool forweb_apply(int dir_fd, const char *name, struct stat *file_stat, struct forweb_run *run, struct forweb_tally *tally);
+struct dirent64 *forweb_next(struct dent_reader *reader, struct forweb_run *run, struct forweb_tally *tally);
+int forweb_stat(int dir_fd, const char *name, struct stat *file_stat, struct forweb_run *run, struct forweb_tally *tally);
+void forweb_tally_add(struct forweb_run *run, struct forweb_tally *tally);
+void forweb_report_times(struct forweb_run *run, double seconds);
+void forweb_run_init(struct forweb_run *run, char *dir_name, struct forweb_opts *opts, struct inode_set *seen);
+bool forweb_enter(int dir_fd, int depth, struct forweb_run *run, struct stat *dir_stat);
+bool forweb_admit(struct forweb_run *run, struct stat *file_stat);
+bool forweb_unchanged(int dir_fd, struct stat *dir_stat, int depth, struct forweb_run *run);
+bool forweb_is_dir(int dir_fd, struct dirent64 *entry);
+void forweb_report(struct forweb_opts *opts, struct forweb_run *run, double seconds);
+int forweb_manifest_load(const char *path, struct forweb_manifest *manifest);
+int forweb_manifest_save(const char *path, struct forweb_manifest *manifest);
+void forweb_manifest_put(struct forweb_manifest *manifest, struct stat *dir_stat);
+int forweb_parallel(char *dir_name, struct forweb_opts *opts, struct forweb_run *run);
+void forweb_visit(struct walk_worker *worker, struct walk_dir *dir);
+int forweb_watch_start(char *dir_name, struct forweb_opts *opts);
+int forweb_watch(char *dir_name, struct forweb_opts *opts);
+void forweb_watch_add(struct forweb_watch *watch, string *path);
+int forweb_watch_read(struct forweb_watch *watch);
+void forweb_watch_flush(struct forweb_watch *watch, struct forweb_run *run, char *buf, size_t buf_len);
 
 // Functions related to prunedir
 int prune_dir(char *argv[]);
-int prune_dir_worker(char *dir_name);
+int parse_prune_opts(char *argv[], struct prune_opts *opts, char **dir_name);
+void prune_visit(struct walk_worker *worker, struct walk_dir *dir);
+void prune_leave(struct walk_worker *worker, struct walk_dir *dir);
+void prune_unlink(struct walk_dir *dir, vector<pair<const char *, off_t> > *batch, struct prune_run *run, unsigned long *deleted);
+void prune_log(struct out_buf *out, const char *stamp, const char *op, off_t size, string *dir_path, const char *name);
+void prune_stamp(char *stamp, size_t len);
+void prune_log_write(struct prune_run *run, struct out_buf *out);
+void prune_report(struct prune_opts *opts, struct prune_run *run, double seconds);
+bool prune_wanted_name(struct prune_opts *opts, const char *name);
+bool prune_wanted(struct prune_opts *opts, struct stat *file_stat);
+int prune_parse_size(const char *text, long long *bytes);
+int prune_parse_age(const char *text, time_t *seconds);
+
+// Functions related to myfind
+int myfind(char *argv[]);
+int parse_find_opts(char *argv[], struct find_opts *opts);
+int find_compile(char *argv[], struct find_opts *opts);
+int find_parse_test(char ***args, struct find_op *op, struct find_opts *opts);
+int find_parse_count(const char *text, struct find_op *op, bool units);
+bool find_eval(vector<find_op> *program, struct find_entry *entry);
+bool find_test(struct find_op *op, struct find_entry *entry);
+struct stat *find_stat(struct find_entry *entry);
+void find_visit(struct walk_worker *worker, struct walk_dir *dir);
+void find_root_file(struct find_run *run, char *name);
+
+// Functions related to mydu
+int mydu(char *argv[]);
+int parse_du_opts(char *argv[], struct du_opts *opts);
+void du_visit(struct walk_worker *worker, struct walk_dir *dir);
+void du_leave(struct walk_worker *worker, struct walk_dir *dir);
+void du_size(unsigned long long bytes, bool human, char *buf, size_t len);
+
+// Functions related to mycp
+int mycp(char *argv[]);
+int parse_cp_opts(char *argv[], struct cp_opts *opts);
+int cp_tree(struct cp_opts *opts, struct cp_run *run, struct stat *source_stat);
+void cp_visit(struct walk_worker *worker, struct walk_dir *dir);
+void cp_leave(struct walk_worker *worker, struct walk_dir *dir);
+int cp_entry(int src_dir, const char *name, unsigned char d_type, int dst_dir, struct cp_run *run);
+int cp_file(int src_dir, const char *src_name, int dst_dir, const char *dst_name, bool follow, struct cp_run *run);
+void cp_report(struct cp_opts *opts, struct cp_run *run, double seconds);
+
+// Functions related to glob patterns
+void glob_compile(const char *pattern, struct glob_pattern *glob);
+bool glob_match(struct glob_pattern *glob, const char *name);
+bool glob_op_match(struct glob_op *op, const char *name, size_t *pos);
 
 // Functions related to nls
 int nls(char *argv[]);
-int get_contents(string folder_name, list<fs_elem> *files, list<fs_elem> *folders);
-int list_files(list<fs_elem> *files);
-int list_dirs(list<fs_elem> *folders);
+int parse_nls_opts(char *argv[], struct nls_opts *opts, list<char *> *dirs);
+int nls_dir(char *dir_name, struct nls_opts *opts);
+int nls_recursive(list<char *> *dirs, struct nls_opts *opts);
+void nls_visit(struct walk_worker *worker, struct walk_dir *dir);
+int nls_summarize(list<char *> *dirs);
+void nls_summary_visit(struct walk_worker *worker, struct walk_dir *dir);
+int nls_stream(char *dir_name, struct nls_opts *opts);
+bool nls_cache_get(struct stat *dir_stat, struct nls_opts *opts, struct nls_contents *contents);
+int nls_cache_watch(int dir_fd, struct stat *dir_stat);
+void nls_cache_put(int wd, struct stat *dir_stat, struct nls_contents *contents);
+void nls_cache_drain();
+void nls_cache_drop(list<nls_cache_entry>::iterator entry);
+int nls_stream_pass(int dir_fd, char *buf, struct nls_opts *opts, int pass);
+void nls_stream_flush(struct nls_opts *opts, struct nls_contents *batch);
+int get_contents(int dir_fd, char *buf, size_t buf_len, struct nls_opts *opts, struct nls_contents *contents);
+int stat_elems(int dir_fd, vector<fs_elem> *elems, struct nls_opts *opts);
+void fill_entry(int dir_fd, struct fs_elem *elem, struct statx *file_stat, struct nls_opts *opts);
+int nls_render(struct out_buf *out, const char *path, struct nls_opts *opts, struct nls_contents *contents);
+unsigned int stat_mask(struct nls_opts *opts);
+int sort_contents(vector<fs_elem> *elems, struct nls_opts *opts, vector<sort_key> *order);
+uint64_t prefix_key(const char *str);
+const char *extension(const char *name);
+int list_files(struct out_buf *out, vector<fs_elem> *files, vector<sort_key> *order);
+int list_dirs(struct out_buf *out, vector<fs_elem> *folders, vector<sort_key> *order);
+int list_columns(struct out_buf *out, vector<fs_elem> *elems, vector<sort_key> *order, int width);
+int list_lines(struct out_buf *out, vector<fs_elem> *elems, vector<sort_key> *order);
+int list_long(struct out_buf *out, struct nls_contents *contents);
+void list_long_entry(struct out_buf *out, fs_elem *elem, int *widths);
+void mode_string(mode_t mode, char *str);
+const string *user_name(uid_t uid);
+const string *group_name(gid_t gid);
+int display_width(const char *str);
+int terminal_width();
+int write_all(int fd, const char *buf, size_t len);
+unsigned long long monotonic_ns();
+
+// Functions related to colours
+void load_colors(const char *ls_colors);
+void build_ext_table(vector<pair<string, string> > *exts);
+uint32_t ext_hash(const char *ext, uint32_t seed);
+const char *ext_color(const char *ext);
+const char *color_code(const string &code);
+
+// Functions related to buffered output
+void out_color(struct out_buf *out, const char *color);
+bool color_sticks(const char *color);
+void out_name(struct out_buf *out, fs_elem *elem);
+void out_blank(struct out_buf *out, char c, size_t count);
+void out_printf(struct out_buf *out, const char *format, ...);
+int out_write(struct out_buf *out, int fd);
+
+// Functions related to batched statx via io_uring
+struct stat_ring *stat_ring_get();
+bool stat_ring_setup(struct stat_ring *ring);
+bool stat_ring_statx(int dir_fd, vector<fs_elem> *elems, vector<size_t> *wanted, vector<struct statx> *stats, unsigned int mask);
+
+// Functions related to the parallel directory walker
+int walk_threads();
+int parse_threads(const char *builtin, char *argv[], int *i, int *threads);
+void walk_start(struct walk_ctx *ctx, list<walk_dir *> *roots, int nthreads);
+void walk_finish(struct walk_ctx *ctx);
+void walk_push(struct walk_worker *worker, struct walk_dir *parent, const char *name, void *data);
+void walk_thread(struct walk_worker *worker);
+struct walk_dir *walk_next(struct walk_worker *worker);
+void walk_release(struct walk_ctx *ctx, struct walk_dir *dir);
+void walk_complete(struct walk_worker *worker, struct walk_dir *dir);
+void walk_path(struct walk_dir *dir, string *path);
+bool inode_set_insert(struct inode_set *set, dev_t dev, ino_t ino);
+void dent_open(struct dent_reader *reader, int fd, char *buf, size_t len);
+struct dirent64 *dent_next(struct dent_reader *reader);
+bool dent_buffered(struct dent_reader *reader);
 
 void refresh_prompt();
 
+// Functions related to long-running builtins
+int long_builtin(int (*builtin)(char *argv[]), char *argv[]);
+pid_t builtin_job();
+void progress_start(const char *name, const char *root);
+void progress_add(unsigned long entries);
+void progress_stop();
+void progress_tick();
+
 // Functions related to evaluating and executing the command
 int evaluate_cmd();
 void parse_tokens(char **argv);
@@ -176,6 +821,12 @@ list<piped> pipe_commands;
 char **first_com;
 char **last_com;
 
+// nls_cache holds recent nls listings, most recently used first;
+// nls_cache_size counts the entries held across all of them
+list<nls_cache_entry> nls_cache;
+size_t nls_cache_size = 0;
+int nls_inotify_fd = -1;
+
 // job variables
 int mode;
 int nextjid = 1;
@@ -201,6 +852,23 @@ char gray[] = "\u001b[90m";
 char reset[] = "\u001b[0m";
 char bold[] = "\u001b[1m";
 
+// colors is the table nls colours entries from, set up once at startup
+struct color_table colors;
+
+// builtin_cancelled is set by ctrl-c when there is no foreground job to
+// send it to, meaning the shell itself is busy with a builtin; the builtin
+// stops at the next entry it reaches. A lock-free atomic is safe to set
+// from the handler and to read from walker threads.
+std::atomic<int> builtin_cancelled(0);
+
+// builtin_child is set in a child forked to run a builtin as a job
+bool builtin_child = false;
+
+// builtin_progress is the progress of the running builtin, and
+// progress_totals how many entries each builtin last found under each tree
+struct progress builtin_progress;
+unordered_map<string, unsigned long> progress_totals;
+
 //*********************************************************
 //
 // Main Function
@@ -219,6 +887,9 @@ int main(int argc, char *argv[])
     Signal(SIGTSTP, sigtstp_handler);
     Signal(SIGCHLD, sigchld_handler);
 
+    // Read the user's colour preferences once
+    load_colors(getenv("LS_COLORS"));
+
     // Get the prompt
     refresh_prompt();
 
@@ -282,6 +953,11 @@ void sigint_handler(int sig)
         // Kill the foreground process, if one exists.
         kill(-pid, sig);
     }
+    else
+    {
+        // Otherwise a builtin is running in the shell; ask it to stop.
+        builtin_cancelled = 1;
+    }
 
     c_int++;
     return;
@@ -555,19 +1231,195 @@ int evaluate_cmd()
         return myhist();
     }
     else if(!strcmp(argv[0], "forweb")) {
-        return forweb(argv);
+        return long_builtin(forweb, argv);
     }
     else if(!strcmp(argv[0], "nls")) {
-        return nls(argv);
+        return long_builtin(nls, argv);
     }
     else if(!strcmp(argv[0], "prunedir")) {
-        return prune_dir(argv);
+        return long_builtin(prune_dir, argv);
+    }
+    else if(!strcmp(argv[0], "myfind")) {
+        return long_builtin(myfind, argv);
+    }
+    else if(!strcmp(argv[0], "mydu")) {
+        return long_builtin(mydu, argv);
+    }
+    else if(!strcmp(argv[0], "mycp")) {
+        return long_builtin(mycp, argv);
     }
     else {
         return external_cmd();
     }
 }
 
+/*
+ * long_builtin - run a builtin that may have a large tree to get through.
+ * With & it runs in a child as a background job. Otherwise it runs in the
+ * shell, and ctrl-c asks it to stop; --progress anywhere in its arguments
+ * shows a progress line as it goes.
+ */
+int long_builtin(int (*builtin)(char *argv[]), char *argv[]) {
+    int retval, kept = 1;
+    pid_t pid;
+
+    // Take --progress out, so the builtin never sees it
+    builtin_progress.show = false;
+    for(int i = 1; argv[i] != NULL; i++) {
+        if(!strcmp(argv[i], "--progress")) {
+            builtin_progress.show = true;
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argv[kept] = NULL;
+
+    builtin_cancelled = 0;
+
+    if(mode == BG) {
+        if((pid = builtin_job()) == 0) {
+            retval = builtin(argv);
+            fflush(stdout);
+            exit(retval);
+        }
+        return pid < 0 ? 1 : 0;
+    }
+
+    retval = builtin(argv);
+
+    if(builtin_cancelled) {
+        fflush(stdout);
+        fprintf(stderr, "%s%s\n", argv[0], ": interrupted");
+        retval = 130;
+    }
+    return retval;
+}
+
+/*
+ * builtin_job - fork the shell to run a builtin as a background job. The
+ * child gets its own process group, so ctrl-c at the prompt leaves it be,
+ * and the default signal handlers. Returns 0 in the child, and the child's
+ * pid (or -1) in the shell.
+ */
+pid_t builtin_job() {
+    sigset_t chld_mask, old_mask;
+    pid_t pid;
+
+    // Hold SIGCHLD until the job is on the list, in case the child exits at once
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+
+    // Anything still buffered would otherwise be printed by both processes
+    fflush(stdout);
+    if((pid = fork()) < 0) {
+        fprintf(stderr, "%s\n", "fork() encountered an error");
+    } else if(pid == 0) {
+        setpgid(0, 0);
+        Signal(SIGINT, SIG_DFL);
+        Signal(SIGTSTP, SIG_DFL);
+        Signal(SIGQUIT, SIG_DFL);
+        Signal(SIGHUP, SIG_DFL);
+        Signal(SIGCHLD, SIG_DFL);
+        builtin_child = true;
+        builtin_progress.show = false;
+    } else {
+        addjob(jobs, pid, BG, current_command());
+        printf("[%d] (%d) %s\n", pid2jid(pid), pid, current_command().c_str());
+    }
+
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return pid;
+}
+
+/*
+ * progress_start - start counting the progress of a builtin through the tree
+ * at root, and with --progress on a terminal start the ticker that shows it
+ */
+void progress_start(const char *name, const char *root) {
+    struct progress *progress = &builtin_progress;
+    struct stat root_stat;
+    unordered_map<string, unsigned long>::iterator found;
+    sigset_t all_signals, old_signals;
+
+    progress->name = name;
+    progress->entries = 0;
+    progress->expected = 0;
+    progress->done = false;
+    progress->key.clear();
+    clock_gettime(CLOCK_MONOTONIC, &progress->start);
+
+    if(stat(root, &root_stat) == 0) {
+        progress->key = string(name) + ":" + to_string(root_stat.st_dev) + ":" + to_string(root_stat.st_ino);
+        if((found = progress_totals.find(progress->key)) != progress_totals.end()) {
+            progress->expected = found->second;
+        }
+    }
+
+    if(progress->show && isatty(STDERR_FILENO)) {
+        // Like the walker's threads, the ticker leaves signals to the main thread
+        sigfillset(&all_signals);
+        pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+        progress->ticker = std::thread(progress_tick);
+        pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    }
+}
+
+/*
+ * progress_add - count entries the running builtin has got through
+ */
+void progress_add(unsigned long entries) {
+    builtin_progress.entries += entries;
+}
+
+/*
+ * progress_stop - stop the ticker and clear its line, and remember how many
+ * entries a finished walk came to for next time
+ */
+void progress_stop() {
+    struct progress *progress = &builtin_progress;
+
+    if(progress->ticker.joinable()) {
+        {
+            lock_guard<mutex> guard(progress->lock);
+            progress->done = true;
+        }
+        progress->cv.notify_all();
+        progress->ticker.join();
+        fprintf(stderr, "\r\033[K");
+    }
+
+    if(!builtin_cancelled && !progress->key.empty()) {
+        progress_totals[progress->key] = progress->entries;
+    }
+}
+
+/*
+ * progress_tick - the body of the ticker: redraw the progress line until
+ * the builtin is done
+ */
+void progress_tick() {
+    struct progress *progress = &builtin_progress;
+    struct timespec now;
+    unique_lock<mutex> guard(progress->lock);
+
+    while(!progress->cv.wait_for(guard, chrono::milliseconds(PROGRESS_INTERVAL_MS), [progress] { return progress->done; })) {
+        unsigned long entries = progress->entries;
+        double seconds, rate;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        seconds = (now.tv_sec - progress->start.tv_sec) + (now.tv_nsec - progress->start.tv_nsec) / 1e9;
+        rate = seconds > 0 ? entries / seconds : 0;
+
+        fprintf(stderr, "\r%s: %lu entries, %.0f entries/s", progress->name, entries, rate);
+        if(progress->expected > entries && rate > 0) {
+            unsigned long left = (progress->expected - entries) / rate;
+            fprintf(stderr, ", about %lu:%02lu left", left / 60, left % 60);
+        }
+        fprintf(stderr, "\033[K");
+    }
+}
+
 /* 
  * external_cmd - If the user has typed an external command then execute
  *    it immediately.  
@@ -803,224 +1655,4683 @@ void update_history(char** toks) {
  * nls - given a directory, list all files, displaying their types
  */
 int nls(char *argv[]) {
-    // Maintain a list of folders and elements
-    char path[256];
-    list<fs_elem> files;
-    list<fs_elem> folders;
-    
-    if(argv[1] != NULL) {
-        for(int i = 1; argv[i] != NULL; i++) {
-            // Make sure the parameter is a directory---not a file
-            if(opendir(argv[i]) == NULL) {
-                fprintf(stderr, "%s%s%s\n", "nls: cannot access '", argv[i], "': No such directory");
-                return 1;
-            }
-            
-            // Find the path
-            realpath(argv[i], path);
-            fprintf(stdout, "%s%s\n", argv[i], ":");
-
-            // Use path to determine the contents of the folder
-            get_contents(path, &files, &folders);
-            // List the contents
-            list_dirs(&folders); list_files(&files);
-
-            // Clear the lists to prepare for the next directory, if one exists
-            folders.clear(); files.clear();
-            if(argv[i + 1] != NULL) {
-                fprintf(stdout, "\n\n");
-            } else {
-                fprintf(stdout, "\n");
-            }
+    struct nls_opts opts;
+    list<char *> dirs;
+    list<char *>::iterator iterator;
+    int retval = 0;
+    bool printed = false;
+
+    if(parse_nls_opts(argv, &opts, &dirs) != 0) {
+        return 2;
+    }
+
+    // If no parameter is passed, look in the current directory
+    if(dirs.empty()) {
+        dirs.push_back((char *) ".");
+    }
+
+    progress_start("nls", dirs.front());
+
+    if(opts.summary) {
+        retval = nls_summarize(&dirs);
+        progress_stop();
+        return retval;
+    }
+
+    if(opts.recursive) {
+        retval = nls_recursive(&dirs, &opts);
+        progress_stop();
+        return retval;
+    }
+
+    for(iterator = dirs.begin(); iterator != dirs.end() && !builtin_cancelled; iterator++) {
+        // Separate each listing from the one before it
+        if(printed) {
+            fprintf(stdout, "\n");
+        }
+
+        if(opts.stream_passes > 0 && nls_stream(*iterator, &opts) != 0) {
+            retval = 1;
+        } else if(opts.stream_passes == 0 && nls_dir(*iterator, &opts) != 0) {
+            retval = 1;
+        } else {
+            printed = true;
         }
-    } else {
-        // If no parameter is passed, look in the current directory
-        // and follow the same procedure as above
-        realpath(".", path);
-        fprintf(stdout, "%s%s\n", ".", ":");
-        get_contents(".", &files, &folders);
-        list_dirs(&folders); list_files(&files);
-        fprintf(stdout, "\n");
     }
-    
-    return 0;
+
+    progress_stop();
+    return retval;
 }
 
 /*
- * get_contents - given a directory, find the files and the folders
+ * parse_nls_opts - split the arguments of nls into option flags and directories
  */
-int get_contents(string location, list<fs_elem> *files, list<fs_elem> *folders) {
-    DIR *directory = opendir(location.c_str());
-    struct dirent *directory_entry;
-    struct stat file_stat;
+int parse_nls_opts(char *argv[], struct nls_opts *opts, list<char *> *dirs) {
+    opts->recursive = false;
+    opts->sort = NLS_SORT_NAME;
+    opts->reverse = false;
+    opts->width = 0;
+    opts->long_format = false;
+    opts->stream_passes = 0;
+    opts->summary = false;
+
+    for(int i = 1; argv[i] != NULL; i++) {
+        // Anything that isn't a flag is a directory to list
+        if(argv[i][0] != '-' || argv[i][1] == '\0') {
+            dirs->push_back(argv[i]);
+            continue;
+        }
 
-    // Open the directory
-    while((directory_entry = readdir(directory)) != 0) {
-        char fq_path[512];
-        sprintf(fq_path, "%s/%s", location.c_str(), directory_entry->d_name);
-        lstat(fq_path, &file_stat);
+        for(char *flag = &argv[i][1]; *flag != '\0'; flag++) {
+            switch(*flag) {
+            case 'R':
+                opts->recursive = true;
+                break;
+            case 'S':
+                opts->sort = NLS_SORT_SIZE;
+                break;
+            case 't':
+                opts->sort = NLS_SORT_TIME;
+                break;
+            case 'X':
+                opts->sort = NLS_SORT_EXT;
+                break;
+            case 'r':
+                opts->reverse = true;
+                break;
+            case 'C':
+                opts->width = terminal_width();
+                break;
+            case 'l':
+                opts->long_format = true;
+                break;
+            case 'U':
+                // Unsorted: stream entries in directory order as they are read
+                opts->sort = NLS_SORT_NONE;
+                opts->stream_passes = max(opts->stream_passes, 1);
+                break;
+            case 's':
+                opts->summary = true;
+                break;
+            case 'D':
+                // Unsorted, but read twice to keep folders ahead of files
+                opts->sort = NLS_SORT_NONE;
+                opts->stream_passes = 2;
+                break;
+            default:
+                fprintf(stderr, "%s%c%s\n", "nls: invalid option -- '", *flag, "'");
+                return 1;
+            }
+        }
+    }
 
-        // Do not look for hidden files---ones that start with .
-        if(directory_entry->d_name[0] != '.')
-        {
-            element.name = directory_entry->d_name;
+    // Like ls, lay out columns by default when writing to a terminal
+    if(opts->width == 0 && isatty(STDOUT_FILENO)) {
+        opts->width = terminal_width();
+    }
 
-            // Determine whether the item is a directory
-            if(S_ISDIR(file_stat.st_mode)) {
-                element.color = blue;
-                (*folders).push_back(element);
+    return 0;
+}
 
-            // a symbolic link
-            } else if(S_ISLNK(file_stat.st_mode)) {
-                element.color = red;
-                (*files).push_back(element);
+/*
+ * nls_dir - list the contents of a single directory
+ */
+int nls_dir(char *dir_name, struct nls_opts *opts) {
+    alignas(struct dirent64) static char buf[WALK_BUFSIZE];
+    struct nls_contents contents;
+    struct stat dir_stat;
+    struct out_buf out;
+    int fd, wd = -1;
+
+    // Listings that need nothing beyond each entry's type can be cached
+    bool cacheable = stat_mask(opts) == (STATX_TYPE | STATX_MODE);
+
+    // An unchanged directory is listed straight from the cache
+    if(!cacheable || stat(dir_name, &dir_stat) != 0 || !nls_cache_get(&dir_stat, opts, &contents)) {
+        // Make sure the parameter is a directory---not a file
+        if((fd = open(dir_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "%s%s%s\n", "nls: cannot access '", dir_name, "': No such directory");
+            return 1;
+        }
 
-            // an executable
-            } else if(file_stat.st_mode & S_IXUSR || file_stat.st_mode & S_IXGRP || file_stat.st_mode & S_IXOTH) {
-                element.color = green;
-                (*files).push_back(element);
+        // Watch before reading, so no change made while reading is missed
+        if(cacheable) {
+            wd = nls_cache_watch(fd, &dir_stat);
+        }
 
-            // or simply a normal file
-            } else {
-                element.color = gray;
-                (*files).push_back(element);
-            }
+        // Use the directory to determine its contents
+        get_contents(fd, buf, sizeof(buf), opts, &contents);
+        close(fd);
+
+        if(wd >= 0) {
+            nls_cache_put(wd, &dir_stat, &contents);
         }
     }
-    
-    closedir(directory);
+
+    // List the contents, written out all at once
+    nls_render(&out, dir_name, opts, &contents);
+    fflush(stdout);
+    out_write(&out, STDOUT_FILENO);
+
     return 0;
 }
 
 /*
- * list_files - given a list of fs_elements---files, in this case---print them
+ * nls_cache_get - fill contents from the cached listing of a directory, if
+ * there is one and nothing has changed since it was read
  */
-int list_files(list<fs_elem> *files) {
-    list<fs_elem>::iterator iterator;
+bool nls_cache_get(struct stat *dir_stat, struct nls_opts *opts, struct nls_contents *contents) {
+    list<nls_cache_entry>::iterator entry;
+
+    nls_cache_drain();
 
-    for(iterator = files->begin(); iterator != files->end(); iterator++) {
-        fprintf(stdout, "%s%s%s ", iterator->color, iterator->name, reset);
+    for(entry = nls_cache.begin(); entry != nls_cache.end(); entry++) {
+        if(entry->dev == dir_stat->st_dev && entry->ino == dir_stat->st_ino) {
+            // Move it to the front, as the most recently used
+            nls_cache.splice(nls_cache.begin(), nls_cache, entry);
+
+            contents->folders = entry->folders;
+            contents->files = entry->files;
+            sort_contents(&contents->folders, opts, &contents->folder_order);
+            sort_contents(&contents->files, opts, &contents->file_order);
+            return true;
+        }
     }
 
-    return 0;
+    return false;
 }
 
 /*
- * list_dirs - given a list of fs_elements---directories, in this case---print them
+ * nls_cache_watch - start watching an open directory for changes, and note
+ * its inode in dir_stat. Returns the watch descriptor, or -1 if it can't
+ * be watched.
  */
-int list_dirs(list<fs_elem> *folders) {
-    list<fs_elem>::iterator iterator;
+int nls_cache_watch(int dir_fd, struct stat *dir_stat) {
+    char fd_path[64];
 
-    for(iterator = folders->begin(); iterator != folders->end(); iterator++) {
-        fprintf(stdout, "%s%s%s ", iterator->color, iterator->name, reset);
+    if(nls_inotify_fd < 0 && (nls_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        return -1;
+    }
+    if(fstat(dir_fd, dir_stat) != 0) {
+        return -1;
     }
 
-    return 0;
+    // Watch the directory that is open, whatever has happened to its path
+    sprintf(fd_path, "/proc/self/fd/%d", dir_fd);
+    return inotify_add_watch(nls_inotify_fd, fd_path, NLS_CACHE_EVENTS);
 }
 
 /*
- * forweb - given a directory, call the worker function
+ * nls_cache_put - keep a directory's listing, evicting the least recently
+ * used listings to stay within NLS_CACHE_DIRS and NLS_CACHE_ENTRIES
  */
-int forweb(char *argv[]) {
-    if(argv[1] != NULL) {
-        return forweb_worker(argv[1]);
-    } else {
-        return forweb_worker((char *) "."); 
+void nls_cache_put(int wd, struct stat *dir_stat, struct nls_contents *contents) {
+    list<nls_cache_entry>::iterator entry;
+    size_t size = contents->folders.size() + contents->files.size();
+
+    // Throw out anything older held for the same directory
+    for(entry = nls_cache.begin(); entry != nls_cache.end(); ) {
+        if(entry->wd == wd || (entry->dev == dir_stat->st_dev && entry->ino == dir_stat->st_ino)) {
+            nls_cache_size -= entry->folders.size() + entry->files.size();
+            entry = nls_cache.erase(entry);
+        } else {
+            entry++;
+        }
+    }
+
+    if(size > NLS_CACHE_ENTRIES) {
+        inotify_rm_watch(nls_inotify_fd, wd);
+        return;
     }
+
+    while(!nls_cache.empty() && (nls_cache.size() >= NLS_CACHE_DIRS || nls_cache_size + size > NLS_CACHE_ENTRIES)) {
+        nls_cache_drop(prev(nls_cache.end()));
+    }
+
+    nls_cache.emplace_front();
+    nls_cache.front().dev = dir_stat->st_dev;
+    nls_cache.front().ino = dir_stat->st_ino;
+    nls_cache.front().wd = wd;
+    nls_cache.front().folders = contents->folders;
+    nls_cache.front().files = contents->files;
+    nls_cache_size += size;
 }
 
 /*
- * forweb_worker - works on a directory to recursively add permissions to files and folders
+ * nls_cache_drain - read every pending inotify event, dropping the listing
+ * of each directory that has changed
  */
-int forweb_worker(char *dir_name) {
-    DIR *directory;
+void nls_cache_drain() {
+    alignas(struct inotify_event) char buf[4096];
+    list<nls_cache_entry>::iterator entry;
+    ssize_t len;
 
-    // Check if the directory exists
-    if((directory = opendir(dir_name)) == NULL) {
-        fprintf(stderr, "%s%s%s\n", "forweb: cannot access '", dir_name, "': No such directory");
-        return 2;
+    if(nls_inotify_fd < 0) {
+        return;
     }
 
-    struct dirent *directory_entry;
-    struct stat file_stat;
-    
-    // Iterate over all directory entries
-    while((directory_entry = readdir(directory)) != 0) {
-        char fq_path[512];
-        sprintf(fq_path, "%s/%s", dir_name, directory_entry->d_name);
-        stat(fq_path, &file_stat);
-
-        // If the entry if a directory, and not .. or ., recursively call the function to enter that directory
-        if(S_ISDIR(file_stat.st_mode)) {
-            if(strcmp(directory_entry->d_name, ".") != 0 && strcmp(directory_entry->d_name, "..") != 0) {
-                // Modify its permissions
-                chmod(fq_path, file_stat.st_mode | S_IROTH | S_IXOTH);
-                forweb_worker(fq_path);
+    while((len = read(nls_inotify_fd, buf, sizeof(buf))) > 0) {
+        for(char *pos = buf; pos < buf + len; ) {
+            struct inotify_event *event = (struct inotify_event *) pos;
+            pos += sizeof(struct inotify_event) + event->len;
+
+            for(entry = nls_cache.begin(); entry != nls_cache.end(); ) {
+                // If events were lost, nothing cached can be trusted
+                if(event->mask & IN_Q_OVERFLOW || entry->wd == event->wd) {
+                    nls_cache_drop(entry++);
+                } else {
+                    entry++;
+                }
             }
-        } else {
-            // Otherwise, it's a file. Modify the permissions appropriately
-            chmod(fq_path, file_stat.st_mode | S_IROTH);
         }
     }
-    
-    // Close the directory
-    closedir(directory);
-    return 0;
 }
 
 /*
- * prune_dir - given a directory, call the worker function
+ * nls_cache_drop - forget a cached listing and stop watching its directory
  */
-int prune_dir(char *argv[]) {
-    if(argv[1] != NULL) {
-        return prune_dir_worker(argv[1]);
-    } else {
-        return prune_dir_worker((char *) ".");
-    }
+void nls_cache_drop(list<nls_cache_entry>::iterator entry) {
+    inotify_rm_watch(nls_inotify_fd, entry->wd);
+    nls_cache_size -= entry->folders.size() + entry->files.size();
+    nls_cache.erase(entry);
 }
 
 /*
- * prune_dir_worker - works on a directory to recursively delete all empty files
+ * nls_stream - list a directory in the order its entries are read, printing
+ * each getdents batch as soon as it arrives. Only one batch is held at a
+ * time, so memory stays bounded however large the directory is. With two
+ * passes, the first prints the folders and the second the files.
  */
-int prune_dir_worker(char *dir_name) {
-    DIR *directory;
+int nls_stream(char *dir_name, struct nls_opts *opts) {
+    char *buf;
+    int fd;
 
-    // Check if the directory exists
-    if((directory = opendir(dir_name)) == NULL) {
-        fprintf(stderr, "%s%s%s\n", "prunedir: cannot access '", dir_name, "': No such directory");
-        return 2;
+    if((fd = open(dir_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "%s%s%s\n", "nls: cannot access '", dir_name, "': No such directory");
+        return 1;
     }
 
-    struct dirent *directory_entry;
-    struct stat file_stat;
-    
-    // Iterate over all directory entries
-    while((directory_entry = readdir(directory)) != 0) {
-        char fq_path[512];
-        sprintf(fq_path, "%s/%s", dir_name, directory_entry->d_name);
-        stat(fq_path, &file_stat);
+    if((buf = (char *) aligned_alloc(alignof(struct dirent64), NLS_STREAM_BUFSIZE)) == NULL) {
+        fprintf(stderr, "%s%s%s%s\n", "nls: cannot list '", dir_name, "': ", strerror(ENOMEM));
+        close(fd);
+        return 1;
+    }
 
-        // If the entry if a directory, and not .. or ., recursively call the function to enter that directory
-        if(S_ISDIR(file_stat.st_mode)) {
-            if(strcmp(directory_entry->d_name, ".") != 0 && strcmp(directory_entry->d_name, "..") != 0) {
-                prune_dir_worker(fq_path);
-            }
+    fprintf(stdout, "%s%s\n", dir_name, ":");
+    fflush(stdout);
+
+    if(opts->stream_passes == 1) {
+        nls_stream_pass(fd, buf, opts, 0);
+    } else {
+        nls_stream_pass(fd, buf, opts, 1);
+        lseek(fd, 0, SEEK_SET);
+        nls_stream_pass(fd, buf, opts, 2);
+    }
+
+    free(buf);
+    close(fd);
+    return 0;
+}
+
+/*
+ * nls_stream_pass - read a directory once, printing every entry (pass 0),
+ * only the folders (pass 1) or only the files (pass 2)
+ */
+int nls_stream_pass(int dir_fd, char *buf, struct nls_opts *opts, int pass) {
+    struct dent_reader reader;
+    struct dirent64 *directory_entry;
+    struct nls_contents batch;
+    size_t kept;
+
+    dent_open(&reader, dir_fd, buf, NLS_STREAM_BUFSIZE);
+    do {
+        while((directory_entry = dent_next(&reader)) != NULL) {
+            unsigned char type = directory_entry->d_type;
+            bool wanted = directory_entry->d_name[0] != '.';
+
+            // d_type alone rules most entries out of a pass without a stat
+            if(pass == 1 && type != DT_DIR && type != DT_UNKNOWN) {
+                wanted = false;
+            } else if(pass == 2 && type == DT_DIR) {
+                wanted = false;
+            }
+
+            if(wanted) {
+                batch.files.emplace_back();
+                batch.files.back().name = directory_entry->d_name;
+                batch.files.back().type = type;
+            }
+
+            if(!dent_buffered(&reader)) {
+                break;
+            }
+        }
+
+        // Stat the batch, drop whatever the stat ruled out, and print the rest
+        stat_elems(dir_fd, &batch.files, opts);
+        progress_add(batch.files.size());
+        kept = 0;
+        for(size_t i = 0; i < batch.files.size(); i++) {
+            if(pass != 0 && S_ISDIR(batch.files[i].mode) != (pass == 1)) {
+                continue;
+            }
+            if(kept != i) {
+                batch.files[kept] = std::move(batch.files[i]);
+            }
+            kept++;
+        }
+        batch.files.resize(kept);
+        nls_stream_flush(opts, &batch);
+    } while(directory_entry != NULL && !builtin_cancelled);
+
+    return 0;
+}
+
+/*
+ * nls_stream_flush - print and then forget a batch of streamed entries
+ */
+void nls_stream_flush(struct nls_opts *opts, struct nls_contents *batch) {
+    struct out_buf out;
+
+    if(batch->files.empty()) {
+        return;
+    }
+
+    sort_contents(&batch->files, opts, &batch->file_order);
+
+    if(opts->long_format) {
+        list_long(&out, batch);
+    } else {
+        list_lines(&out, &batch->files, &batch->file_order);
+    }
+    out_color(&out, NULL);
+    out_write(&out, STDOUT_FILENO);
+    batch->files.clear();
+    batch->file_order.clear();
+}
+
+/*
+ * nls_recursive - list each directory and every subdirectory beneath it. The
+ * parallel walker reads the tree; listings finish in any order and are held
+ * here until everything before them has printed, so the output is the same
+ * depth-first order a single thread would give.
+ */
+int nls_recursive(list<char *> *dirs, struct nls_opts *opts) {
+    struct nls_tree tree;
+    struct walk_ctx ctx;
+    list<walk_dir *> roots;
+    list<char *>::iterator iterator;
+    vector<nls_listing *> pending;
+    int retval = 0;
+    bool printed = false;
+
+    for(iterator = dirs->begin(); iterator != dirs->end(); iterator++) {
+        nls_listing *listing = new nls_listing();
+        listing->path = *iterator;
+
+        walk_dir *root = new walk_dir();
+        root->name = *iterator;
+        root->data = listing;
+        roots.push_back(root);
+
+        // pending is a stack, so the first root goes on top
+        pending.insert(pending.begin(), listing);
+    }
+
+    tree.opts = opts;
+    ctx.visit = nls_visit;
+    ctx.arg = &tree;
+    walk_start(&ctx, &roots, walk_threads());
+
+    while(!pending.empty()) {
+        nls_listing *listing = pending.back();
+        pending.pop_back();
+
+        // Wait for this listing's turn to be ready
+        {
+            unique_lock<mutex> guard(tree.lock);
+            tree.cv.wait(guard, [listing] { return listing->done; });
+        }
+
+        if(builtin_cancelled || listing->error == ECANCELED) {
+            // Interrupted: nothing more is printed, but every listing is still waited for
+        } else if(listing->error != 0) {
+            fflush(stdout);
+            fprintf(stderr, "%s%s%s%s\n", "nls: cannot open directory '", listing->path.c_str(), "': ", strerror(listing->error));
+            retval = 1;
+        } else {
+            if(printed) {
+                listing->text.insert(0, "\n");
+            }
+            fflush(stdout);
+            write_all(STDOUT_FILENO, listing->text.data(), listing->text.size());
+            printed = true;
+        }
+
+        // Subdirectories print next, in the order they were listed
+        for(auto child = listing->children.rbegin(); child != listing->children.rend(); child++) {
+            pending.push_back(*child);
+        }
+        delete listing;
+    }
+
+    walk_finish(&ctx);
+    return retval;
+}
+
+/*
+ * nls_visit - walker callback for nls -R: render one directory's listing and
+ * queue its subdirectories
+ */
+void nls_visit(struct walk_worker *worker, struct walk_dir *dir) {
+    struct nls_tree *tree = (struct nls_tree *) worker->ctx->arg;
+    struct nls_listing *listing = (struct nls_listing *) dir->data;
+    struct nls_contents contents;
+    vector<sort_key>::iterator iterator;
+    struct out_buf out;
+
+    if(dir->fd < 0) {
+        listing->error = dir->error;
+    } else {
+        get_contents(dir->fd, worker->buf, sizeof(worker->buf), tree->opts, &contents);
+
+        nls_render(&out, listing->path.c_str(), tree->opts, &contents);
+        listing->text = std::move(out.text);
+
+        // Queue subdirectories in the order they were listed
+        for(iterator = contents.folder_order.begin(); iterator != contents.folder_order.end(); iterator++) {
+            fs_elem *folder = &contents.folders[iterator->index];
+            nls_listing *child = new nls_listing();
+            child->path = listing->path;
+            if(child->path.back() != '/') {
+                child->path += "/";
+            }
+            child->path += folder->name;
+
+            listing->children.push_back(child);
+            walk_push(worker, dir, folder->name.c_str(), child);
+        }
+    }
+
+    lock_guard<mutex> guard(tree->lock);
+    listing->done = true;
+    tree->cv.notify_all();
+}
+
+/*
+ * nls_summarize - for each directory, count the files and directories in
+ * its whole subtree and total their apparent and allocated sizes. Every
+ * subtree is walked at once by the parallel walker, and a file with several
+ * hard links is only counted the first time one of them is seen.
+ */
+int nls_summarize(list<char *> *dirs) {
+    struct inode_set seen;
+    struct walk_ctx ctx;
+    list<walk_dir *> roots;
+    list<char *>::iterator iterator;
+    vector<nls_summary *> summaries;
+    int retval = 0;
+
+    for(iterator = dirs->begin(); iterator != dirs->end(); iterator++) {
+        nls_summary *summary = new nls_summary();
+        summary->path = *iterator;
+        summaries.push_back(summary);
+
+        walk_dir *root = new walk_dir();
+        root->name = *iterator;
+        root->data = summary;
+        roots.push_back(root);
+    }
+
+    ctx.visit = nls_summary_visit;
+    ctx.keep_parents = true;
+    ctx.arg = &seen;
+    walk_start(&ctx, &roots, walk_threads());
+    walk_finish(&ctx);
+
+    for(size_t i = 0; i < summaries.size(); i++) {
+        nls_summary *summary = summaries[i];
+
+        // Totals cut short by ctrl-c would only mislead
+        if(builtin_cancelled) {
+            delete summary;
+            continue;
+        }
+
+        if(summary->error != 0) {
+            fprintf(stderr, "%s%s%s%s\n", "nls: cannot open directory '", summary->path.c_str(), "': ", strerror(summary->error));
+            retval = 1;
+        } else {
+            // The total still prints, but leaves out what couldn't be read
+            if(summary->failures > 0) {
+                retval = 1;
+            }
+            fprintf(stdout, "%s%s%s: %lu files, %lu directories, %llu bytes apparent, %llu bytes allocated\n",
+                    colors.dir, summary->path.c_str(), reset, summary->files.load(), summary->dirs.load(),
+                    summary->apparent.load(), summary->allocated.load());
+        }
+        delete summary;
+    }
+
+    return retval;
+}
+
+/*
+ * nls_summary_visit - walker callback for nls -s: add up one directory's
+ * entries and queue its subdirectories
+ */
+void nls_summary_visit(struct walk_worker *worker, struct walk_dir *dir) {
+    struct inode_set *seen = (struct inode_set *) worker->ctx->arg;
+    struct nls_summary *summary = (struct nls_summary *) dir->data;
+    struct dent_reader reader;
+    struct dirent64 *directory_entry;
+    struct stat file_stat;
+    unsigned long entries = 0, files = 0, dirs = 1;
+    unsigned long long apparent = 0, allocated = 0;
+    string path;
+
+    if(dir->fd < 0) {
+        // An unreadable root has no total; beneath it, say what was left out
+        if(dir->depth == 0) {
+            summary->error = dir->error;
+        } else if(dir->error != ELOOP && dir->error != ECANCELED) {
+            walk_path(dir->parent, &path);
+            fprintf(stderr, "%s%s%s%s%s\n", "nls: cannot open directory '", path.c_str(), dir->name.c_str(), "': ", strerror(dir->error));
+            summary->failures++;
+        }
+        return;
+    }
+
+    // The directory itself
+    if(fstat(dir->fd, &file_stat) == 0) {
+        apparent += file_stat.st_size;
+        allocated += (unsigned long long) file_stat.st_blocks * 512;
+    }
+
+    dent_open(&reader, dir->fd, worker->buf, sizeof(worker->buf));
+    while(!builtin_cancelled && (directory_entry = dent_next(&reader)) != NULL) {
+        entries++;
+        if(directory_entry->d_type == DT_DIR) {
+            walk_push(worker, dir, directory_entry->d_name, summary);
+            continue;
+        }
+
+        if(fstatat(dir->fd, directory_entry->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0) {
+            // A file removed since it was read takes up nothing; any other
+            // failure leaves the total short, so say so
+            if(errno != ENOENT) {
+                walk_path(dir, &path);
+                fprintf(stderr, "%s%s%s%s%s\n", "nls: cannot access '", path.c_str(), directory_entry->d_name, "': ", strerror(errno));
+                summary->failures++;
+            }
+            continue;
+        }
+        if(S_ISDIR(file_stat.st_mode)) {
+            walk_push(worker, dir, directory_entry->d_name, summary);
+            continue;
+        }
+
+        // Only a file with other links can have been counted already
+        if(file_stat.st_nlink > 1 && !inode_set_insert(seen, file_stat.st_dev, file_stat.st_ino)) {
+            continue;
+        }
+
+        files++;
+        apparent += file_stat.st_size;
+        allocated += (unsigned long long) file_stat.st_blocks * 512;
+    }
+
+    // One update per directory keeps the shared counters quiet
+    progress_add(entries);
+    summary->files += files;
+    summary->dirs += dirs;
+    summary->apparent += apparent;
+    summary->allocated += allocated;
+}
+
+/*
+ * get_contents - given an open directory, find the files and the folders,
+ * and the order to list them in
+ */
+int get_contents(int dir_fd, char *buf, size_t buf_len, struct nls_opts *opts, struct nls_contents *contents) {
+    struct dent_reader reader;
+    struct dirent64 *directory_entry;
+    vector<fs_elem> batch;
+
+    dent_open(&reader, dir_fd, buf, buf_len);
+    do {
+        // Gather one getdents buffer's worth of entries, then stat them together
+        while((directory_entry = dent_next(&reader)) != NULL) {
+            // Do not look for hidden files---ones that start with .
+            if(directory_entry->d_name[0] != '.') {
+                batch.emplace_back();
+                batch.back().name = directory_entry->d_name;
+                batch.back().type = directory_entry->d_type;
+            }
+
+            if(!dent_buffered(&reader)) {
+                break;
+            }
+        }
+
+        stat_elems(dir_fd, &batch, opts);
+        progress_add(batch.size());
+        for(size_t i = 0; i < batch.size(); i++) {
+            if(S_ISDIR(batch[i].mode)) {
+                contents->folders.push_back(std::move(batch[i]));
+            } else {
+                contents->files.push_back(std::move(batch[i]));
+            }
+        }
+        batch.clear();
+    } while(directory_entry != NULL && !builtin_cancelled);
+
+    sort_contents(&contents->folders, opts, &contents->folder_order);
+    sort_contents(&contents->files, opts, &contents->file_order);
+
+    return 0;
+}
+
+/*
+ * stat_elems - fill in the type, colour and whatever else the options need
+ * for a batch of entries. Directories and links are known from d_type
+ * alone, unless the sort or long format needs more; anything else needs its
+ * mode to tell whether it is executable. Those that need a stat are sent to
+ * io_uring together, or are stat-ed one at a time if that isn't available.
+ */
+int stat_elems(int dir_fd, vector<fs_elem> *elems, struct nls_opts *opts) {
+    unsigned int mask = stat_mask(opts);
+    vector<struct statx> stats(elems->size());
+    vector<size_t> wanted;
+
+    for(size_t i = 0; i < elems->size(); i++) {
+        unsigned char type = (*elems)[i].type;
+
+        memset(&stats[i], 0, sizeof(struct statx));
+        if(type == DT_DIR && mask == (STATX_TYPE | STATX_MODE)) {
+            stats[i].stx_mode = S_IFDIR;
+        } else if(type == DT_LNK && mask == (STATX_TYPE | STATX_MODE)) {
+            stats[i].stx_mode = S_IFLNK;
+        } else {
+            wanted.push_back(i);
+        }
+    }
+
+    if(!stat_ring_statx(dir_fd, elems, &wanted, &stats, mask)) {
+        for(size_t i = 0; i < wanted.size(); i++) {
+            struct statx *file_stat = &stats[wanted[i]];
+            if(statx(dir_fd, (*elems)[wanted[i]].name.c_str(), AT_SYMLINK_NOFOLLOW, mask, file_stat) != 0) {
+                memset(file_stat, 0, sizeof(struct statx));
+                file_stat->stx_mode = S_IFREG;
+            }
+        }
+    }
+
+    for(size_t i = 0; i < elems->size(); i++) {
+        fill_entry(dir_fd, &(*elems)[i], &stats[i], opts);
+    }
+
+    return 0;
+}
+
+/*
+ * fill_entry - copy what nls shows of an entry out of its statx, and pick
+ * its colour
+ */
+void fill_entry(int dir_fd, struct fs_elem *elem, struct statx *file_stat, struct nls_opts *opts) {
+    char link[PATH_MAX];
+    ssize_t link_len;
+
+    elem->mode = file_stat->stx_mode;
+    elem->nlink = file_stat->stx_nlink;
+    elem->uid = file_stat->stx_uid;
+    elem->gid = file_stat->stx_gid;
+    elem->size = file_stat->stx_size;
+    elem->mtime.tv_sec = file_stat->stx_mtime.tv_sec;
+    elem->mtime.tv_nsec = file_stat->stx_mtime.tv_nsec;
+
+    // The long format shows where links point
+    elem->link.clear();
+    if(opts->long_format && S_ISLNK(elem->mode)) {
+        if((link_len = readlinkat(dir_fd, elem->name.c_str(), link, sizeof(link))) > 0) {
+            elem->link.assign(link, link_len);
+        }
+    }
+
+    // Determine whether the item is a directory
+    if(S_ISDIR(elem->mode)) {
+        elem->color = colors.dir;
+
+    // a symbolic link
+    } else if(S_ISLNK(elem->mode)) {
+        elem->color = colors.link;
+
+    // a pipe, socket or device
+    } else if(S_ISFIFO(elem->mode)) {
+        elem->color = colors.fifo;
+    } else if(S_ISSOCK(elem->mode)) {
+        elem->color = colors.sock;
+    } else if(S_ISBLK(elem->mode)) {
+        elem->color = colors.blk;
+    } else if(S_ISCHR(elem->mode)) {
+        elem->color = colors.chr;
+
+    // an executable
+    } else if(elem->mode & S_IXUSR || elem->mode & S_IXGRP || elem->mode & S_IXOTH) {
+        elem->color = colors.exec;
+
+    // or simply a normal file, which may be coloured by its extension
+    } else if((elem->color = ext_color(extension(elem->name.c_str()))) == NULL) {
+        elem->color = colors.file;
+    }
+}
+
+/*
+ * nls_render - print the listing of one directory: its path, then its
+ * folders and its files, each either on one line or laid out in columns
+ */
+int nls_render(struct out_buf *out, const char *path, struct nls_opts *opts, struct nls_contents *contents) {
+    out_printf(out, "%s%s\n", path, ":");
+
+    if(opts->long_format) {
+        list_long(out, contents);
+    } else if(opts->width > 0) {
+        list_columns(out, &contents->folders, &contents->folder_order, opts->width);
+        list_columns(out, &contents->files, &contents->file_order, opts->width);
+    } else {
+        list_dirs(out, &contents->folders, &contents->folder_order);
+        list_files(out, &contents->files, &contents->file_order);
+        out_blank(out, '\n', 1);
+    }
+
+    // Leave the terminal in its normal colour
+    out_color(out, NULL);
+
+    return 0;
+}
+
+/*
+ * stat_mask - the statx fields nls needs: the type and mode for colouring,
+ * plus whatever the sort order and long format show
+ */
+unsigned int stat_mask(struct nls_opts *opts) {
+    unsigned int mask = STATX_TYPE | STATX_MODE;
+
+    if(opts->sort == NLS_SORT_SIZE) {
+        mask |= STATX_SIZE;
+    } else if(opts->sort == NLS_SORT_TIME) {
+        mask |= STATX_MTIME;
+    }
+    if(opts->long_format) {
+        mask |= STATX_NLINK | STATX_UID | STATX_GID | STATX_SIZE | STATX_MTIME;
+    }
+
+    return mask;
+}
+
+/*
+ * sort_contents - order a directory's entries for printing. Only the
+ * (key, index) pairs move; ties on the key fall back to the full names.
+ */
+int sort_contents(vector<fs_elem> *elems, struct nls_opts *opts, vector<sort_key> *order) {
+    order->resize(elems->size());
+
+    for(size_t i = 0; i < elems->size(); i++) {
+        fs_elem *elem = &(*elems)[i];
+        uint64_t key;
+
+        // Size and time sort largest and newest first, so store them inverted.
+        // Times before 1970 are negative; flipping the sign bit keeps their order
+        if(opts->sort == NLS_SORT_NONE) {
+            key = i;
+        } else if(opts->sort == NLS_SORT_SIZE) {
+            key = ~(uint64_t) elem->size;
+        } else if(opts->sort == NLS_SORT_TIME) {
+            key = ~((uint64_t) ((int64_t) elem->mtime.tv_sec * 1000000000 + elem->mtime.tv_nsec) ^ (1ULL << 63));
+        } else if(opts->sort == NLS_SORT_EXT) {
+            key = prefix_key(extension(elem->name.c_str()));
+        } else {
+            key = prefix_key(elem->name.c_str());
+        }
+
+        (*order)[i].key = key;
+        (*order)[i].index = i;
+    }
+
+    std::sort(order->begin(), order->end(), [elems, opts](const sort_key &a, const sort_key &b) {
+        if(a.key != b.key) {
+            return a.key < b.key;
+        }
+
+        const char *a_name = (*elems)[a.index].name.c_str();
+        const char *b_name = (*elems)[b.index].name.c_str();
+        int cmp;
+
+        if(opts->sort == NLS_SORT_EXT && (cmp = strcmp(extension(a_name), extension(b_name))) != 0) {
+            return cmp < 0;
+        }
+        return strcmp(a_name, b_name) < 0;
+    });
+
+    if(opts->reverse) {
+        std::reverse(order->begin(), order->end());
+    }
+
+    return 0;
+}
+
+/*
+ * prefix_key - the first eight bytes of a string as a big-endian integer, so
+ * integer order agrees with strcmp order
+ */
+uint64_t prefix_key(const char *str) {
+    uint64_t key = 0;
+    int i;
+
+    for(i = 0; i < 8 && str[i] != '\0'; i++) {
+        key = (key << 8) | (unsigned char) str[i];
+    }
+
+    return key << (8 * (8 - i));
+}
+
+/*
+ * extension - the part of a file name after its last dot, or "" if there is none
+ */
+const char *extension(const char *name) {
+    const char *dot = strrchr(name, '.');
+
+    return dot != NULL ? dot + 1 : "";
+}
+
+/*
+ * list_files - given a list of fs_elements---files, in this case---print them
+ */
+int list_files(struct out_buf *out, vector<fs_elem> *files, vector<sort_key> *order) {
+    vector<sort_key>::iterator iterator;
+
+    for(iterator = order->begin(); iterator != order->end(); iterator++) {
+        fs_elem *file = &(*files)[iterator->index];
+        out_name(out, file);
+        out_blank(out, ' ', 1);
+    }
+
+    return 0;
+}
+
+/*
+ * list_dirs - given a list of fs_elements---directories, in this case---print them
+ */
+int list_dirs(struct out_buf *out, vector<fs_elem> *folders, vector<sort_key> *order) {
+    vector<sort_key>::iterator iterator;
+
+    for(iterator = order->begin(); iterator != order->end(); iterator++) {
+        fs_elem *folder = &(*folders)[iterator->index];
+        out_name(out, folder);
+        out_blank(out, ' ', 1);
+    }
+
+    return 0;
+}
+
+/*
+ * list_lines - print entries one to a line
+ */
+int list_lines(struct out_buf *out, vector<fs_elem> *elems, vector<sort_key> *order) {
+    vector<sort_key>::iterator iterator;
+
+    for(iterator = order->begin(); iterator != order->end(); iterator++) {
+        fs_elem *elem = &(*elems)[iterator->index];
+        out_name(out, elem);
+        out_blank(out, '\n', 1);
+    }
+
+    return 0;
+}
+
+/*
+ * list_columns - print entries down columns, as ls -C does. A single pass
+ * finds each name's width and the widest; every column is then that wide
+ * plus a gap, and as many fit in the terminal as will.
+ */
+int list_columns(struct out_buf *out, vector<fs_elem> *elems, vector<sort_key> *order, int width) {
+    size_t count = order->size();
+    vector<int> widths(count);
+    int widest = 0;
+    size_t rows, cols;
+
+    if(count == 0) {
+        return 0;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        widths[i] = display_width((*elems)[(*order)[i].index].name.c_str());
+        widest = max(widest, widths[i]);
+    }
+
+    int col_width = widest + 2;
+    cols = max(1, width / col_width);
+    rows = (count + cols - 1) / cols;
+    cols = (count + rows - 1) / rows;
+
+    for(size_t row = 0; row < rows; row++) {
+        for(size_t col = 0; col < cols; col++) {
+            size_t i = col * rows + row;
+            if(i >= count) {
+                break;
+            }
+
+            fs_elem *elem = &(*elems)[(*order)[i].index];
+            out_name(out, elem);
+
+            // Pad out to the next column, unless this is the last on the row
+            if(col + 1 < cols && i + rows < count) {
+                out_blank(out, ' ', col_width - widths[i]);
+            }
+        }
+        out_blank(out, '\n', 1);
+    }
+
+    return 0;
+}
+
+/*
+ * list_long - print one entry per line with its mode, links, owner, group,
+ * size and modification time, folders first. Field widths come from one
+ * pass over every entry so the columns line up.
+ */
+int list_long(struct out_buf *out, struct nls_contents *contents) {
+    vector<fs_elem> *groups[2] = { &contents->folders, &contents->files };
+    vector<sort_key> *orders[2] = { &contents->folder_order, &contents->file_order };
+    int widths[4] = { 0, 0, 0, 0 };
+    char field[32];
+
+    for(int g = 0; g < 2; g++) {
+        for(size_t i = 0; i < groups[g]->size(); i++) {
+            fs_elem *elem = &(*groups[g])[i];
+
+            widths[0] = max(widths[0], snprintf(field, sizeof(field), "%lu", (unsigned long) elem->nlink));
+            widths[1] = max(widths[1], (int) user_name(elem->uid)->size());
+            widths[2] = max(widths[2], (int) group_name(elem->gid)->size());
+            widths[3] = max(widths[3], snprintf(field, sizeof(field), "%lld", (long long) elem->size));
+        }
+    }
+
+    for(int g = 0; g < 2; g++) {
+        for(size_t i = 0; i < orders[g]->size(); i++) {
+            list_long_entry(out, &(*groups[g])[(*orders[g])[i].index], widths);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * list_long_entry - print the long format line of a single entry
+ */
+void list_long_entry(struct out_buf *out, fs_elem *elem, int *widths) {
+    char mode[11];
+    char date[32];
+    struct tm l_time;
+    time_t now = time(NULL);
+
+    mode_string(elem->mode, mode);
+
+    // Like ls, show the year instead of the time for anything over six months old
+    localtime_r(&elem->mtime.tv_sec, &l_time);
+    if(elem->mtime.tv_sec > now - 60 * 60 * 24 * 182 && elem->mtime.tv_sec <= now) {
+        strftime(date, sizeof(date), "%b %e %H:%M", &l_time);
+    } else {
+        strftime(date, sizeof(date), "%b %e  %Y", &l_time);
+    }
+
+    // The fields before the name are printed in the normal colour
+    out_color(out, NULL);
+    out_printf(out, "%s %*lu %-*s %-*s %*lld %s ", mode, widths[0], (unsigned long) elem->nlink,
+            widths[1], user_name(elem->uid)->c_str(), widths[2], group_name(elem->gid)->c_str(),
+            widths[3], (long long) elem->size, date);
+    out_name(out, elem);
+
+    if(!elem->link.empty()) {
+        out_color(out, NULL);
+        out_printf(out, " -> %s", elem->link.c_str());
+    }
+    out_blank(out, '\n', 1);
+}
+
+/*
+ * mode_string - write the ls-style type and permission string of mode into str
+ */
+void mode_string(mode_t mode, char *str) {
+    const char *rwx = "rwxrwxrwx";
+
+    if(S_ISDIR(mode)) str[0] = 'd';
+    else if(S_ISLNK(mode)) str[0] = 'l';
+    else if(S_ISCHR(mode)) str[0] = 'c';
+    else if(S_ISBLK(mode)) str[0] = 'b';
+    else if(S_ISFIFO(mode)) str[0] = 'p';
+    else if(S_ISSOCK(mode)) str[0] = 's';
+    else str[0] = '-';
+
+    for(int i = 0; i < 9; i++) {
+        str[i + 1] = (mode & (1 << (8 - i))) ? rwx[i] : '-';
+    }
+
+    // setuid, setgid and sticky bits replace the matching execute bits
+    if(mode & S_ISUID) str[3] = (mode & S_IXUSR) ? 's' : 'S';
+    if(mode & S_ISGID) str[6] = (mode & S_IXGRP) ? 's' : 'S';
+    if(mode & S_ISVTX) str[9] = (mode & S_IXOTH) ? 't' : 'T';
+    str[10] = '\0';
+}
+
+/*
+ * user_name - the name of a user id, or the id itself if it has none. Each
+ * thread caches what it has looked up, so a directory owned by a few users
+ * costs a few passwd lookups rather than one per entry.
+ */
+const string *user_name(uid_t uid) {
+    thread_local unordered_map<uid_t, string> cache;
+    unordered_map<uid_t, string>::iterator found;
+    struct passwd pwd, *result = NULL;
+    long size;
+    int err;
+
+    if((found = cache.find(uid)) != cache.end()) {
+        return &found->second;
+    }
+
+    size = sysconf(_SC_GETPW_R_SIZE_MAX);
+    vector<char> buf(size > 0 ? size : 1024);
+
+    // The size sysconf gives is only a hint, so grow until the entry fits
+    while((err = getpwuid_r(uid, &pwd, buf.data(), buf.size(), &result)) == ERANGE) {
+        buf.resize(buf.size() * 2);
+    }
+    if(err == 0 && result != NULL) {
+        return &cache.emplace(uid, result->pw_name).first->second;
+    }
+    return &cache.emplace(uid, to_string(uid)).first->second;
+}
+
+/*
+ * group_name - the name of a group id, or the id itself if it has none,
+ * cached per thread like user_name
+ */
+const string *group_name(gid_t gid) {
+    thread_local unordered_map<gid_t, string> cache;
+    unordered_map<gid_t, string>::iterator found;
+    struct group grp, *result = NULL;
+    long size;
+    int err;
+
+    if((found = cache.find(gid)) != cache.end()) {
+        return &found->second;
+    }
+
+    size = sysconf(_SC_GETGR_R_SIZE_MAX);
+    vector<char> buf(size > 0 ? size : 1024);
+
+    // A group's member list can outgrow the hinted size, so grow on ERANGE
+    while((err = getgrgid_r(gid, &grp, buf.data(), buf.size(), &result)) == ERANGE) {
+        buf.resize(buf.size() * 2);
+    }
+    if(err == 0 && result != NULL) {
+        return &cache.emplace(gid, result->gr_name).first->second;
+    }
+    return &cache.emplace(gid, to_string(gid)).first->second;
+}
+
+/*
+ * display_width - the number of terminal columns a UTF-8 string takes up,
+ * counting one per character
+ */
+int display_width(const char *str) {
+    int width = 0;
+
+    for(; *str != '\0'; str++) {
+        if(((unsigned char) *str & 0xC0) != 0x80) {
+            width++;
+        }
+    }
+
+    return width;
+}
+
+/*
+ * terminal_width - the width of the terminal on stdout, or of $COLUMNS, or 80
+ */
+int terminal_width() {
+    struct winsize size;
+    char *columns;
+
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) {
+        return size.ws_col;
+    }
+    if((columns = getenv("COLUMNS")) != NULL && atoi(columns) > 0) {
+        return atoi(columns);
+    }
+
+    return 80;
+}
+
+/*
+ * monotonic_ns - nanoseconds on the monotonic clock, for timing
+ */
+unsigned long long monotonic_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * write_all - write the whole buffer to fd, carrying on after short writes
+ */
+int write_all(int fd, const char *buf, size_t len) {
+    ssize_t written;
+
+    while(len > 0) {
+        if((written = write(fd, buf, len)) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+/*
+ * load_colors - set up the colour table from an LS_COLORS string such as
+ * "di=01;34:ln=01;36:*.tar=01;31". Unset or unknown keys keep hfsh's own
+ * colours. Only single extensions ("*.gz", not "*.tar.gz") are matched.
+ */
+void load_colors(const char *ls_colors) {
+    vector<pair<string, string> > exts;
+    string spec = ls_colors != NULL ? ls_colors : "";
+    size_t start = 0, end;
+
+    colors.dir = blue;
+    colors.link = red;
+    colors.exec = green;
+    colors.file = colors.fifo = colors.sock = colors.blk = colors.chr = gray;
+
+    while(start < spec.size()) {
+        if((end = spec.find(':', start)) == string::npos) {
+            end = spec.size();
+        }
+
+        string item = spec.substr(start, end - start);
+        size_t equals = item.find('=');
+        start = end + 1;
+        if(equals == string::npos) {
+            continue;
+        }
+
+        string key = item.substr(0, equals);
+        string code = item.substr(equals + 1);
+
+        if(key.compare(0, 2, "*.") == 0 && key.find('.', 2) == string::npos && key.size() > 2) {
+            exts.push_back(make_pair(key.substr(2), code));
+        } else if(key == "di") {
+            colors.dir = color_code(code);
+        } else if(key == "ln" && code != "target") {
+            colors.link = color_code(code);
+        } else if(key == "ex") {
+            colors.exec = color_code(code);
+        } else if(key == "fi" || (key == "no" && colors.file == gray)) {
+            colors.file = color_code(code);
+        } else if(key == "pi") {
+            colors.fifo = color_code(code);
+        } else if(key == "so") {
+            colors.sock = color_code(code);
+        } else if(key == "bd") {
+            colors.blk = color_code(code);
+        } else if(key == "cd") {
+            colors.chr = color_code(code);
+        }
+    }
+
+    build_ext_table(&exts);
+}
+
+/*
+ * color_code - the escape sequence for an LS_COLORS code such as "01;34",
+ * kept for the life of the shell
+ */
+const char *color_code(const string &code) {
+    colors.strings.push_back("\u001b[" + code + "m");
+    return colors.strings.back().c_str();
+}
+
+/*
+ * build_ext_table - build the perfect hash of extension colours. Extensions
+ * are grouped into buckets; the biggest buckets go first, and each is given
+ * the first displacement that sends all of its extensions to free slots.
+ */
+void build_ext_table(vector<pair<string, string> > *exts) {
+    unordered_map<string, const char *> unique;
+    vector<const char *> keys;
+    vector<vector<const char *> > buckets;
+    vector<size_t> by_size;
+    size_t nslots, nbuckets;
+
+    colors.disp.clear();
+    colors.ext_keys.clear();
+    colors.ext_colors.clear();
+
+    // A later setting for the same extension replaces an earlier one
+    for(size_t i = 0; i < exts->size(); i++) {
+        unique[(*exts)[i].first] = color_code((*exts)[i].second);
+    }
+    if(unique.empty()) {
+        return;
+    }
+    for(auto &ext : unique) {
+        colors.strings.push_back(ext.first);
+        keys.push_back(colors.strings.back().c_str());
+    }
+
+    for(nslots = unique.size() + unique.size() / 4 + 1; ; nslots *= 2) {
+        bool placed = true;
+
+        nbuckets = unique.size() / 4 + 1;
+        buckets.assign(nbuckets, vector<const char *>());
+        colors.disp.assign(nbuckets, 0);
+        colors.ext_keys.assign(nslots, NULL);
+        colors.ext_colors.assign(nslots, NULL);
+
+        for(size_t i = 0; i < keys.size(); i++) {
+            buckets[ext_hash(keys[i], 0) % nbuckets].push_back(keys[i]);
+        }
+
+        by_size.resize(nbuckets);
+        for(size_t b = 0; b < nbuckets; b++) {
+            by_size[b] = b;
+        }
+        sort(by_size.begin(), by_size.end(), [&buckets](size_t a, size_t b) {
+            return buckets[a].size() > buckets[b].size();
+        });
+
+        for(size_t i = 0; i < nbuckets && placed && !buckets[by_size[i]].empty(); i++) {
+            vector<const char *> *bucket = &buckets[by_size[i]];
+            vector<size_t> slots(bucket->size());
+            uint32_t disp;
+
+            for(disp = 1; disp < (1 << 16); disp++) {
+                bool fits = true;
+
+                for(size_t k = 0; k < bucket->size() && fits; k++) {
+                    slots[k] = ext_hash((*bucket)[k], disp) % nslots;
+                    fits = colors.ext_keys[slots[k]] == NULL && find(slots.begin(), slots.begin() + k, slots[k]) == slots.begin() + k;
+                }
+                if(fits) {
+                    break;
+                }
+            }
+
+            // Out of displacements: start again with more room
+            if(disp == (1 << 16)) {
+                placed = false;
+                break;
+            }
+
+            colors.disp[by_size[i]] = disp;
+            for(size_t k = 0; k < bucket->size(); k++) {
+                colors.ext_keys[slots[k]] = (*bucket)[k];
+                colors.ext_colors[slots[k]] = unique[(*bucket)[k]];
+            }
+        }
+
+        if(placed) {
+            return;
+        }
+    }
+}
+
+/*
+ * ext_hash - FNV-1a hash of an extension, varied by seed
+ */
+uint32_t ext_hash(const char *ext, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ (seed * 16777619u);
+
+    for(; *ext != '\0'; ext++) {
+        hash ^= (unsigned char) *ext;
+        hash *= 16777619u;
+    }
+
+    return hash ^ (hash >> 15);
+}
+
+/*
+ * ext_color - the colour LS_COLORS gives an extension, or NULL if none
+ */
+const char *ext_color(const char *ext) {
+    size_t slot;
+
+    if(colors.disp.empty() || *ext == '\0') {
+        return NULL;
+    }
+
+    slot = ext_hash(ext, colors.disp[ext_hash(ext, 0) % colors.disp.size()]) % colors.ext_keys.size();
+    if(colors.ext_keys[slot] != NULL && !strcmp(colors.ext_keys[slot], ext)) {
+        return colors.ext_colors[slot];
+    }
+
+    return NULL;
+}
+
+/*
+ * out_color - switch the colour of what follows, emitting an escape only if
+ * it differs from the colour already in effect. NULL is the normal colour.
+ * A new foreground wouldn't clear a background or an attribute such as
+ * bold left by the colour before, so only then is there a reset between.
+ */
+void out_color(struct out_buf *out, const char *color) {
+    if(color == out->color) {
+        return;
+    }
+
+    if(color != NULL && color_sticks(out->color)) {
+        out->text += reset;
+    }
+    out->text += color != NULL ? color : reset;
+    out->color = color;
+}
+
+/*
+ * color_sticks - whether a colour escape sets more than the foreground: a
+ * background, or an attribute such as bold or underline. Those show on the
+ * blanks after a name and outlast the next foreground.
+ */
+bool color_sticks(const char *color) {
+    int codes[16], ncodes = 0;
+
+    if(color == NULL) {
+        return false;
+    }
+
+    // Step over the ESC [ and read the ;-separated codes up to the m
+    for(color += 2; ncodes < 16; color++) {
+        codes[ncodes] = 0;
+        for(; *color >= '0' && *color <= '9'; color++) {
+            codes[ncodes] = codes[ncodes] * 10 + (*color - '0');
+        }
+        ncodes++;
+        if(*color != ';') {
+            break;
+        }
+    }
+
+    for(int i = 0; i < ncodes; i++) {
+        if(codes[i] == 38 && i + 1 < ncodes) {
+            // 38;5;N and 38;2;R;G;B are foregrounds as well
+            i += codes[i + 1] == 5 ? 2 : 4;
+        } else if(codes[i] != 0 && codes[i] != 39 && (codes[i] < 30 || codes[i] > 37) && (codes[i] < 90 || codes[i] > 97)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * out_name - append an entry's name in its colour
+ */
+void out_name(struct out_buf *out, fs_elem *elem) {
+    out_color(out, elem->color);
+    out->text += elem->name;
+}
+
+/*
+ * out_blank - append count copies of a space or newline between names. A
+ * plain foreground colour doesn't show on them and is left on for the next
+ * name; one that would paint them is reset first.
+ */
+void out_blank(struct out_buf *out, char c, size_t count) {
+    if(color_sticks(out->color)) {
+        out_color(out, NULL);
+    }
+    out->text.append(count, c);
+}
+
+/*
+ * out_printf - append formatted text
+ */
+void out_printf(struct out_buf *out, const char *format, ...) {
+    char buf[1024];
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+
+    if(len < (int) sizeof(buf)) {
+        out->text.append(buf, len);
+        return;
+    }
+
+    // Too long for the stack buffer: format again straight into the output
+    size_t start = out->text.size();
+    out->text.resize(start + len + 1);
+    va_start(args, format);
+    vsnprintf(&out->text[start], len + 1, format, args);
+    va_end(args);
+    out->text.resize(start + len);
+}
+
+/*
+ * out_write - write everything gathered so far to fd and empty the buffer
+ */
+int out_write(struct out_buf *out, int fd) {
+    int retval = write_all(fd, out->text.data(), out->text.size());
+
+    out->text.clear();
+    return retval;
+}
+
+/*
+ * forweb - given a directory, call the worker function
+ */
+int forweb(char *argv[]) {
+    alignas(struct dirent64) static char buf[WALK_BUFSIZE];
+    struct forweb_opts opts;
+    struct forweb_run run;
+    struct forweb_manifest old_manifest, next_manifest;
+    struct inode_set seen;
+    struct timespec start, end;
+    char *dir_name = (char *) ".";
+    int dir_fd, manifest_error, retval = 0;
+
+    if(parse_forweb_opts(argv, &opts, &dir_name) != 0) {
+        return 2;
+    }
+
+    if(opts.watch) {
+        return forweb_watch_start(dir_name, &opts);
+    }
+
+    forweb_run_init(&run, dir_name, &opts, &seen);
+
+    // With a manifest, directories the last run saw unchanged are only passed through
+    if(opts.manifest != NULL) {
+        // One that can't be read couldn't be saved over either, so stop here
+        if((manifest_error = forweb_manifest_load(opts.manifest, &old_manifest)) > 0) {
+            fprintf(stderr, "%s%s%s%s\n", "forweb: cannot read manifest '", opts.manifest, "': ", strerror(manifest_error));
+            return 1;
+        }
+        if(manifest_error < 0) {
+            fprintf(stderr, "%s%s%s\n", "forweb: ignoring manifest '", opts.manifest, "': not a forweb manifest");
+        }
+        run.old = &old_manifest;
+        run.next = &next_manifest;
+    }
+
+    progress_start("forweb", dir_name);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if(opts.threads > 0) {
+        retval = forweb_parallel(dir_name, &opts, &run);
+    } else if((dir_fd = open(dir_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        // Check if the directory exists
+        run.error = errno;
+    } else {
+        string path = dir_name;
+        retval = forweb_worker(dir_fd, 0, &path, &run, buf, sizeof(buf), NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    progress_stop();
+
+    if(run.error != 0) {
+        fprintf(stderr, "%s%s%s\n", "forweb: cannot access '", dir_name, "': No such directory");
+        return 2;
+    }
+
+    // An interrupted run left directories half done, and a dry run changed
+    // nothing, so either way the old manifest still holds
+    if(builtin_cancelled) {
+        return 1;
+    }
+    if(opts.manifest != NULL && !opts.dry_run && forweb_manifest_save(opts.manifest, &next_manifest) != 0) {
+        fprintf(stderr, "%s%s%s%s\n", "forweb: cannot write manifest '", opts.manifest, "': ", strerror(errno));
+        retval = 1;
+    }
+
+    forweb_report(&opts, &run, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    return retval;
+}
+
+/*
+ * parse_forweb_opts - split the arguments of forweb into option flags and
+ * the directory to work on
+ */
+int parse_forweb_opts(char *argv[], struct forweb_opts *opts, char **dir_name) {
+    opts->threads = 0;
+    opts->manifest = NULL;
+    opts->watch = false;
+    opts->budget = FORWEB_WATCH_BUDGET;
+    opts->xdev = false;
+    opts->dry_run = false;
+
+    for(int i = 1; argv[i] != NULL; i++) {
+        // Anything that isn't a flag is the directory
+        if(argv[i][0] != '-' || argv[i][1] == '\0') {
+            *dir_name = argv[i];
+            continue;
+        }
+
+        if(!strncmp(argv[i], "-j", 2)) {
+            if(parse_threads("forweb", argv, &i, &opts->threads)) {
+                return 1;
+            }
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-i")) {
+            // -i FILE: incremental, against the manifest kept in FILE
+            if(argv[i + 1] == NULL) {
+                fprintf(stderr, "%s\n", "forweb: option requires an argument -- 'i'");
+                return 1;
+            }
+            opts->manifest = argv[++i];
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-n")) {
+            // Dry run: report what would change, and where the time goes
+            opts->dry_run = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-xdev")) {
+            // Stay on the filesystem the directory is on
+            opts->xdev = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "--watch")) {
+            opts->watch = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "--budget")) {
+            // --budget N: watch at most N directories
+            if(argv[i + 1] == NULL || atoi(argv[i + 1]) <= 0) {
+                fprintf(stderr, "%s\n", "forweb: --budget needs a number of directories");
+                return 1;
+            }
+            opts->budget = atoi(argv[++i]);
+            continue;
+        }
+
+        fprintf(stderr, "%s%s%s\n", "forweb: invalid option -- '", &argv[i][1], "'");
+        return 1;
+    }
+
+    if(opts->watch && opts->dry_run) {
+        fprintf(stderr, "%s\n", "forweb: --watch cannot be a dry run");
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * forweb_report - print how many entries were looked at and changed, and
+ * for a dry or parallel run how fast they went by
+ */
+void forweb_report(struct forweb_opts *opts, struct forweb_run *run, double seconds) {
+    fprintf(stdout, "forweb: %lu entries examined, %lu %s, %lu duplicates skipped",
+            run->entries.load(), run->modified.load(), opts->dry_run ? "would change" : "modified", run->duplicates.load());
+    if(opts->xdev) {
+        fprintf(stdout, ", %lu mount points skipped", run->crossings.load());
+    }
+    if(opts->manifest != NULL) {
+        fprintf(stdout, ", %lu directories unchanged", run->unchanged.load());
+    }
+    if(opts->threads > 0) {
+        fprintf(stdout, " with %d threads", opts->threads);
+    }
+    fprintf(stdout, "\n");
+
+    // A dry run says what it would have changed, by the mode each entry has now
+    if(opts->dry_run) {
+        for(mode_t mode = 0; mode <= 07777; mode++) {
+            unsigned long files = run->changes[0][mode], dirs = run->changes[1][mode];
+
+            if(files > 0 || dirs > 0) {
+                fprintf(stdout, "    %04o: %lu files, %lu directories\n", mode, files, dirs);
+            }
+        }
+    }
+
+    if(run->timed) {
+        forweb_report_times(run, seconds);
+    }
+}
+
+/*
+ * forweb_report_times - print how fast entries went by and how the time was
+ * split between reading directories, stat and chmod. With several threads
+ * those times add up across threads, so can come to more than the total.
+ */
+void forweb_report_times(struct forweb_run *run, double seconds) {
+    fprintf(stdout, "forweb: %.3f s (%.0f entries/s); getdents %.3f s, stat %.3f s, chmod %.3f s\n",
+            seconds, seconds > 0 ? run->entries / seconds : 0.0,
+            run->getdents_ns / 1e9, run->stat_ns / 1e9, run->chmod_ns / 1e9);
+}
+
+/*
+ * forweb_worker - works on an open directory to recursively add permissions
+ * to files and folders. Everything is looked up relative to dir_fd, so no
+ * path is ever resolved from the root; path is only kept for error messages.
+ * Symlinks are neither followed nor changed. The directory is read to the
+ * end before any subdirectory is entered, so one getdents buffer serves the
+ * whole walk. dir_fd is closed on return. Past FORWEB_FD_DEPTH levels, a
+ * directory closes its fd while each subdirectory is walked and passes
+ * up_fd, to get it back through the subdirectory's "..", so the fds open
+ * at once stay bounded however deep the tree goes.
+ */
+int forweb_worker(int dir_fd, int depth, string *path, struct forweb_run *run, char *buf, size_t buf_len, int *up_fd) {
+    struct dent_reader reader;
+    struct dirent64 *directory_entry;
+    struct stat dir_stat, file_stat;
+    struct forweb_tally tally = {};
+    vector<string> subdirs;
+    vector<string>::iterator iterator;
+    int retval = 0;
+    bool unchanged;
+
+    if(!forweb_enter(dir_fd, depth, run, &dir_stat)) {
+        forweb_up(dir_fd, path, up_fd);
+        return 0;
+    }
+    unchanged = forweb_unchanged(dir_fd, &dir_stat, depth, run);
+
+    // Watch before reading, so nothing created meanwhile goes unseen
+    if(run->watch != NULL) {
+        forweb_watch_add(run->watch, path);
+    }
+
+    // Iterate over all directory entries
+    dent_open(&reader, dir_fd, buf, buf_len);
+    while(!builtin_cancelled && (directory_entry = forweb_next(&reader, run, &tally)) != NULL) {
+        // Nothing has come or gone here since the last run, so only look for subdirectories
+        if(unchanged) {
+            if(forweb_is_dir(dir_fd, directory_entry) && forweb_stat(dir_fd, directory_entry->d_name, &file_stat, run, &tally) == 0 &&
+               S_ISDIR(file_stat.st_mode) && forweb_admit(run, &file_stat)) {
+                subdirs.push_back(directory_entry->d_name);
+            }
+            continue;
+        }
+
+        tally.entries++;
+        if(forweb_stat(dir_fd, directory_entry->d_name, &file_stat, run, &tally) != 0 || !forweb_admit(run, &file_stat)) {
+            continue;
+        }
+
+        forweb_apply(dir_fd, directory_entry->d_name, &file_stat, run, &tally);
+
+        // If the entry is a directory, enter it once this one is read
+        if(S_ISDIR(file_stat.st_mode)) {
+            subdirs.push_back(directory_entry->d_name);
+        }
+    }
+
+    forweb_tally_add(run, &tally);
+
+    for(iterator = subdirs.begin(); iterator != subdirs.end() && !builtin_cancelled; iterator++) {
+        size_t path_len = path->size();
+        bool let_go = depth >= FORWEB_FD_DEPTH;
+        struct stat back_stat;
+        int sub_fd;
+
+        path->append("/");
+        path->append(*iterator);
+
+        if((sub_fd = openat(dir_fd, iterator->c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "%s%s%s%s\n", "forweb: cannot access '", path->c_str(), "': ", strerror(errno));
+            retval = 1;
+            path->resize(path_len);
+            continue;
+        }
+
+        if(let_go) {
+            close(dir_fd);
+        }
+        if(forweb_worker(sub_fd, depth + 1, path, run, buf, buf_len, let_go ? &dir_fd : NULL) != 0) {
+            retval = 1;
+        }
+        path->resize(path_len);
+
+        // The way back has to lead to this same directory, or it was moved
+        // meanwhile and the rest of it can't be found safely
+        if(let_go && dir_fd >= 0 && (fstat(dir_fd, &back_stat) != 0 ||
+           back_stat.st_dev != dir_stat.st_dev || back_stat.st_ino != dir_stat.st_ino)) {
+            fprintf(stderr, "%s%s%s\n", "forweb: cannot return to '", path->c_str(), "': it was moved");
+            close(dir_fd);
+            dir_fd = -1;
+        }
+        if(dir_fd < 0) {
+            retval = 1;
+            break;
+        }
+    }
+
+    forweb_up(dir_fd, path, up_fd);
+    return retval;
+}
+
+/*
+ * forweb_up - close a directory forweb_worker is done with. If up_fd is
+ * given, the caller let go of its own fd, so first open the parent through
+ * ".." and hand it back there. Once the way back is lost it stays lost, and
+ * the callers above stop quietly.
+ */
+void forweb_up(int dir_fd, string *path, int *up_fd) {
+    if(dir_fd < 0) {
+        if(up_fd != NULL) {
+            *up_fd = -1;
+        }
+        return;
+    }
+
+    if(up_fd != NULL && (*up_fd = openat(dir_fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "%s%s%s%s\n", "forweb: cannot return from '", path->c_str(), "': ", strerror(errno));
+    }
+    close(dir_fd);
+}
+
+/*
+ * forweb_apply - make an entry readable by others, and a directory
+ * searchable too. The mode is only written when it would change, since
+ * every chmod dirties the inode and bumps its ctime, and never on a dry
+ * run; returns whether it was, or would have been.
+ */
+bool forweb_apply(int dir_fd, const char *name, struct stat *file_stat, struct forweb_run *run, struct forweb_tally *tally) {
+    bool is_dir = S_ISDIR(file_stat->st_mode);
+    mode_t wanted = is_dir ? S_IROTH | S_IXOTH : S_IROTH;
+    unsigned long long start;
+    int retval;
+
+    if((file_stat->st_mode & wanted) == wanted) {
+        return false;
+    }
+
+    if(run->dry_run) {
+        run->changes[is_dir][file_stat->st_mode & 07777]++;
+        tally->modified++;
+        return true;
+    }
+
+    start = run->timed ? monotonic_ns() : 0;
+    retval = fchmodat(dir_fd, name, (file_stat->st_mode | wanted) & 07777, 0);
+    if(run->timed) {
+        tally->chmod_ns += monotonic_ns() - start;
+    }
+
+    if(retval != 0) {
+        return false;
+    }
+    tally->modified++;
+    return true;
+}
+
+/*
+ * forweb_next - the next entry of the directory, timing the getdents64 calls
+ * on a timed run
+ */
+struct dirent64 *forweb_next(struct dent_reader *reader, struct forweb_run *run, struct forweb_tally *tally) {
+    struct dirent64 *entry;
+    unsigned long long start;
+
+    if(!run->timed || dent_buffered(reader)) {
+        return dent_next(reader);
+    }
+
+    start = monotonic_ns();
+    entry = dent_next(reader);
+    tally->getdents_ns += monotonic_ns() - start;
+
+    return entry;
+}
+
+/*
+ * forweb_stat - lstat an entry of the directory, timing it on a timed run
+ */
+int forweb_stat(int dir_fd, const char *name, struct stat *file_stat, struct forweb_run *run, struct forweb_tally *tally) {
+    unsigned long long start;
+    int retval;
+
+    if(!run->timed) {
+        return fstatat(dir_fd, name, file_stat, AT_SYMLINK_NOFOLLOW);
+    }
+
+    start = monotonic_ns();
+    retval = fstatat(dir_fd, name, file_stat, AT_SYMLINK_NOFOLLOW);
+    tally->stat_ns += monotonic_ns() - start;
+
+    return retval;
+}
+
+/*
+ * forweb_tally_add - add what one directory came to onto the run's totals
+ */
+void forweb_tally_add(struct forweb_run *run, struct forweb_tally *tally) {
+    progress_add(tally->entries);
+    run->entries += tally->entries;
+    run->modified += tally->modified;
+    run->getdents_ns += tally->getdents_ns;
+    run->stat_ns += tally->stat_ns;
+    run->chmod_ns += tally->chmod_ns;
+}
+
+/*
+ * forweb_unchanged - for an incremental run, record the directory's ctime
+ * in the new manifest and say whether it matches the old one. Creating,
+ * removing or renaming an entry advances a directory's ctime, so a match
+ * means its entries are as the last run left them. Changes made inside a
+ * file (chmod, writes) don't reach the directory; a full run catches those.
+ */
+bool forweb_unchanged(int dir_fd, struct stat *dir_stat, int depth, struct forweb_run *run) {
+    mode_t wanted = S_IROTH | S_IXOTH;
+
+    if(run->next == NULL) {
+        return false;
+    }
+
+    // A skipped parent didn't look at this directory's own mode, so do it here
+    if(depth > 0 && (dir_stat->st_mode & wanted) != wanted) {
+        if(run->dry_run) {
+            run->changes[1][dir_stat->st_mode & 07777]++;
+            run->modified++;
+        } else if(fchmod(dir_fd, (dir_stat->st_mode | wanted) & 07777) == 0) {
+            run->modified++;
+            fstat(dir_fd, dir_stat);
+        }
+    }
+
+    // A ctime this close to the start could yet be reused by a change made
+    // during the run, within the clock's granularity, so it isn't trusted
+    if(dir_stat->st_ctim.tv_sec >= run->started - 1) {
+        dir_stat->st_ctim.tv_sec = 0;
+        dir_stat->st_ctim.tv_nsec = 0;
+    }
+    forweb_manifest_put(run->next, dir_stat);
+
+    dev_ino key = { dir_stat->st_dev, dir_stat->st_ino };
+    size_t shard = dev_ino_hash()(key) % INODE_SET_SHARDS;
+    unordered_map<dev_ino, struct timespec, dev_ino_hash>::iterator found = run->old->shards[shard].find(key);
+
+    if(dir_stat->st_ctim.tv_sec == 0 || found == run->old->shards[shard].end() ||
+       found->second.tv_sec != dir_stat->st_ctim.tv_sec || found->second.tv_nsec != dir_stat->st_ctim.tv_nsec) {
+        return false;
+    }
+
+    run->unchanged++;
+    return true;
+}
+
+/*
+ * forweb_is_dir - whether a directory entry is itself a directory (and not
+ * a symlink to one), from its d_type where the filesystem gives one
+ */
+bool forweb_is_dir(int dir_fd, struct dirent64 *entry) {
+    struct stat file_stat;
+
+    if(entry->d_type != DT_UNKNOWN) {
+        return entry->d_type == DT_DIR;
+    }
+
+    return fstatat(dir_fd, entry->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(file_stat.st_mode);
+}
+
+/*
+ * forweb_run_init - set up the totals and settings of a run over dir_name,
+ * with seen to remember what it has been through
+ */
+void forweb_run_init(struct forweb_run *run, char *dir_name, struct forweb_opts *opts, struct inode_set *seen) {
+    run->path = dir_name;
+    run->error = 0;
+    run->xdev = opts->xdev;
+    run->dev = 0;
+    run->seen = seen;
+    run->entries = 0;
+    run->modified = 0;
+    run->failures = 0;
+    run->unchanged = 0;
+    run->duplicates = 0;
+    run->crossings = 0;
+    run->dry_run = opts->dry_run;
+    run->timed = opts->dry_run || opts->threads > 0;
+    for(int i = 0; i <= 07777; i++) {
+        run->changes[0][i] = 0;
+        run->changes[1][i] = 0;
+    }
+    run->getdents_ns = 0;
+    run->stat_ns = 0;
+    run->chmod_ns = 0;
+    run->started = time(NULL);
+    run->old = NULL;
+    run->next = NULL;
+    run->watch = NULL;
+}
+
+/*
+ * forweb_enter - fstat an open directory before going through it. Any
+ * other directory was admitted by forweb_admit from its parent, so only
+ * the root is remembered here.
+ */
+bool forweb_enter(int dir_fd, int depth, struct forweb_run *run, struct stat *dir_stat) {
+    if(fstat(dir_fd, dir_stat) != 0) {
+        return false;
+    }
+
+    if(depth == 0) {
+        run->dev = dir_stat->st_dev;
+        inode_set_insert(run->seen, dir_stat->st_dev, dir_stat->st_ino);
+    }
+
+    return true;
+}
+
+/*
+ * forweb_admit - whether to give an entry its permissions: symlinks are
+ * left alone, a directory already reached by another path (such as a bind
+ * mount) or a file with several links only counts the first time, and
+ * with -xdev a mount point is not touched
+ */
+bool forweb_admit(struct forweb_run *run, struct stat *file_stat) {
+    if(S_ISLNK(file_stat->st_mode)) {
+        return false;
+    }
+
+    if(S_ISDIR(file_stat->st_mode)) {
+        if(run->xdev && file_stat->st_dev != run->dev) {
+            run->crossings++;
+            return false;
+        }
+        if(!inode_set_insert(run->seen, file_stat->st_dev, file_stat->st_ino)) {
+            run->duplicates++;
+            return false;
+        }
+    } else if(file_stat->st_nlink > 1 && !inode_set_insert(run->seen, file_stat->st_dev, file_stat->st_ino)) {
+        run->duplicates++;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * forweb_manifest_load - read a manifest saved by an earlier run. A missing
+ * file is an empty manifest. Returns 0, the errno of a file that can't be
+ * read, or -1 for one that isn't a manifest, which is left empty.
+ */
+int forweb_manifest_load(const char *path, struct forweb_manifest *manifest) {
+    struct forweb_manifest_record record;
+    struct stat file_stat;
+    string data;
+    size_t magic_len = strlen(FORWEB_MANIFEST_MAGIC);
+    ssize_t nread;
+    int fd;
+
+    if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return errno == ENOENT ? 0 : errno;
+    }
+
+    if(fstat(fd, &file_stat) == 0) {
+        data.resize(file_stat.st_size);
+    }
+    for(size_t pos = 0; pos < data.size(); pos += nread) {
+        if((nread = read(fd, &data[pos], data.size() - pos)) <= 0) {
+            if(nread < 0 && errno == EINTR) {
+                nread = 0;
+                continue;
+            }
+            if(nread < 0) {
+                int error = errno;
+                close(fd);
+                return error;
+            }
+            data.resize(pos);
+            break;
+        }
+    }
+    close(fd);
+
+    if(data.size() < magic_len || data.compare(0, magic_len, FORWEB_MANIFEST_MAGIC) != 0 ||
+       (data.size() - magic_len) % sizeof(record) != 0) {
+        return -1;
+    }
+
+    for(size_t pos = magic_len; pos < data.size(); pos += sizeof(record)) {
+        memcpy(&record, &data[pos], sizeof(record));
+
+        dev_ino key = { (dev_t) record.dev, (ino_t) record.ino };
+        struct timespec ctime = { (time_t) record.ctime_sec, (long) record.ctime_nsec };
+        manifest->shards[dev_ino_hash()(key) % INODE_SET_SHARDS][key] = ctime;
+    }
+
+    return 0;
+}
+
+/*
+ * forweb_manifest_save - write the manifest to a temporary file with one
+ * write and rename it over the old one, so a run that is cut short never
+ * leaves half a manifest behind
+ */
+int forweb_manifest_save(const char *path, struct forweb_manifest *manifest) {
+    struct forweb_manifest_record record;
+    unordered_map<dev_ino, struct timespec, dev_ino_hash>::iterator iterator;
+    string data = FORWEB_MANIFEST_MAGIC;
+    string tmp_path = string(path) + ".tmp";
+    int fd;
+
+    for(int i = 0; i < INODE_SET_SHARDS; i++) {
+        for(iterator = manifest->shards[i].begin(); iterator != manifest->shards[i].end(); iterator++) {
+            record.dev = iterator->first.dev;
+            record.ino = iterator->first.ino;
+            record.ctime_sec = iterator->second.tv_sec;
+            record.ctime_nsec = iterator->second.tv_nsec;
+            data.append((const char *) &record, sizeof(record));
+        }
+    }
+
+    if((fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        return -1;
+    }
+    if(write_all(fd, data.data(), data.size()) != 0) {
+        close(fd);
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+    close(fd);
+
+    return rename(tmp_path.c_str(), path);
+}
+
+/*
+ * forweb_manifest_put - record the ctime of the directory described by dir_stat
+ */
+void forweb_manifest_put(struct forweb_manifest *manifest, struct stat *dir_stat) {
+    dev_ino key = { dir_stat->st_dev, dir_stat->st_ino };
+    size_t shard = dev_ino_hash()(key) % INODE_SET_SHARDS;
+
+    lock_guard<mutex> guard(manifest->locks[shard]);
+    manifest->shards[shard][key] = dir_stat->st_ctim;
+}
+
+/*
+ * forweb_parallel - add permissions across the tree with a pool of walker
+ * threads, each with its own directory fds and getdents buffer
+ */
+int forweb_parallel(char *dir_name, struct forweb_opts *opts, struct forweb_run *run) {
+    struct walk_ctx ctx;
+    list<walk_dir *> roots;
+
+    walk_dir *root = new walk_dir();
+    root->name = dir_name;
+    root->data = run;
+    roots.push_back(root);
+
+    ctx.visit = forweb_visit;
+    ctx.keep_parents = true;
+    ctx.arg = run;
+    walk_start(&ctx, &roots, opts->threads);
+    walk_finish(&ctx);
+
+    return run->failures > 0 ? 1 : 0;
+}
+
+/*
+ * forweb_visit - walker callback for forweb -j: add permissions to one
+ * directory's entries and queue its subdirectories
+ */
+void forweb_visit(struct walk_worker *worker, struct walk_dir *dir) {
+    struct forweb_run *run = (struct forweb_run *) worker->ctx->arg;
+    struct dent_reader reader;
+    struct dirent64 *directory_entry;
+    struct stat dir_stat, file_stat;
+    struct forweb_tally tally = {};
+    bool unchanged;
+    string path;
+
+    if(dir->fd < 0) {
+        // A directory swapped for a symlink since it was read is not followed
+        if(dir->depth == 0 && dir->error != ECANCELED) {
+            run->error = dir->error;
+        } else if(dir->depth > 0 && dir->error != ELOOP && dir->error != ECANCELED) {
+            walk_path(dir->parent, &path);
+            fprintf(stderr, "%s%s%s%s%s\n", "forweb: cannot access '", path.c_str(), dir->name.c_str(), "': ", strerror(dir->error));
+            run->failures++;
+        }
+        return;
+    }
+
+    if(!forweb_enter(dir->fd, dir->depth, run, &dir_stat)) {
+        return;
+    }
+    unchanged = forweb_unchanged(dir->fd, &dir_stat, dir->depth, run);
+
+    dent_open(&reader, dir->fd, worker->buf, sizeof(worker->buf));
+    while(!builtin_cancelled && (directory_entry = forweb_next(&reader, run, &tally)) != NULL) {
+        if(unchanged) {
+            if(forweb_is_dir(dir->fd, directory_entry) && forweb_stat(dir->fd, directory_entry->d_name, &file_stat, run, &tally) == 0 &&
+               S_ISDIR(file_stat.st_mode) && forweb_admit(run, &file_stat)) {
+                walk_push(worker, dir, directory_entry->d_name, run);
+            }
+            continue;
+        }
+
+        tally.entries++;
+        if(forweb_stat(dir->fd, directory_entry->d_name, &file_stat, run, &tally) != 0 || !forweb_admit(run, &file_stat)) {
+            continue;
+        }
+
+        forweb_apply(dir->fd, directory_entry->d_name, &file_stat, run, &tally);
+
+        if(S_ISDIR(file_stat.st_mode)) {
+            walk_push(worker, dir, directory_entry->d_name, run);
+        }
+    }
+
+    forweb_tally_add(run, &tally);
+}
+
+/*
+ * forweb_watch_start - fork a process to keep the tree readable, and run it
+ * as a background job
+ */
+int forweb_watch_start(char *dir_name, struct forweb_opts *opts) {
+    pid_t pid;
+
+    // Started with &, this is already the background job
+    if(builtin_child) {
+        return forweb_watch(dir_name, opts);
+    }
+
+    if((pid = builtin_job()) == 0) {
+        exit(forweb_watch(dir_name, opts));
+    }
+
+    return pid < 0 ? 1 : 0;
+}
+
+/*
+ * forweb_watch - the body of forweb --watch: put the tree right once,
+ * watching every directory on the way, then give new and changed entries
+ * their permissions as inotify reports them. Bursts of events are let
+ * settle and dealt with together, each entry once. Runs until the tree
+ * itself is removed.
+ */
+int forweb_watch(char *dir_name, struct forweb_opts *opts) {
+    alignas(struct dirent64) static char buf[WALK_BUFSIZE];
+    struct forweb_run run;
+    struct forweb_watch watch;
+    struct inode_set seen;
+    struct pollfd poll_fd;
+    struct timespec first, now;
+    int dir_fd, timeout;
+
+    forweb_run_init(&run, dir_name, opts, &seen);
+    run.watch = &watch;
+
+    watch.budget = opts->budget;
+    watch.unwatched = 0;
+    watch.overflow = false;
+    if((watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        fprintf(stderr, "%s%s\n", "forweb: cannot watch: ", strerror(errno));
+        return 1;
+    }
+
+    if((dir_fd = open(dir_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "%s%s%s\n", "forweb: cannot access '", dir_name, "': No such directory");
+        return 2;
+    }
+
+    string path = dir_name;
+    forweb_worker(dir_fd, 0, &path, &run, buf, sizeof(buf), NULL);
+    fprintf(stdout, "forweb: %lu entries examined, %lu modified, watching %lu directories\n",
+            run.entries.load(), run.modified.load(), (unsigned long) watch.paths.size());
+    fflush(stdout);
+
+    poll_fd.fd = watch.fd;
+    poll_fd.events = POLLIN;
+
+    while(!watch.paths.empty()) {
+        // Wait for the first event of a burst, then until the burst goes quiet,
+        // but never hold the first event back for long
+        if(watch.pending.empty() && !watch.overflow) {
+            timeout = -1;
+        } else {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timeout = FORWEB_WATCH_DELAY - ((now.tv_sec - first.tv_sec) * 1000 + (now.tv_nsec - first.tv_nsec) / 1000000);
+            timeout = max(0, min(timeout, FORWEB_WATCH_SETTLE));
+        }
+
+        if(poll(&poll_fd, 1, timeout) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if(poll_fd.revents & POLLIN) {
+            bool idle = watch.pending.empty() && !watch.overflow;
+
+            if(forweb_watch_read(&watch) != 0) {
+                break;
+            }
+            if(idle) {
+                clock_gettime(CLOCK_MONOTONIC, &first);
+            }
+            if(timeout != 0) {
+                continue;
+            }
+        }
+
+        forweb_watch_flush(&watch, &run, buf, sizeof(buf));
+    }
+
+    close(watch.fd);
+    return 0;
+}
+
+/*
+ * forweb_watch_add - watch the directory at path, unless the budget is
+ * spent. A directory renamed within the tree keeps its watch descriptor, so
+ * adding it again just brings its path up to date.
+ */
+void forweb_watch_add(struct forweb_watch *watch, string *path) {
+    int wd;
+
+    if((int) watch->paths.size() >= watch->budget) {
+        // Say so once; from then on directories past the budget go unwatched
+        if(watch->unwatched++ == 0) {
+            fprintf(stderr, "%s%d%s\n", "forweb: watch budget of ", watch->budget, " directories reached; new directories are not watched");
+        }
+        return;
+    }
+
+    if((wd = inotify_add_watch(watch->fd, path->c_str(), FORWEB_WATCH_EVENTS)) < 0) {
+        if(errno == ENOSPC) {
+            // The system ran out of watches first, so that is the budget now
+            fprintf(stderr, "%s%s%s%s%s\n", "forweb: cannot watch '", path->c_str(), "': ", strerror(errno), "; new directories are not watched");
+            watch->budget = watch->paths.size();
+            watch->unwatched++;
+        } else if(errno != ENOENT) {
+            // A directory already gone needs no watch, but anything else is reported
+            fprintf(stderr, "%s%s%s%s\n", "forweb: cannot watch '", path->c_str(), "': ", strerror(errno));
+        }
+        return;
+    }
+
+    watch->paths[wd] = *path;
+}
+
+/*
+ * forweb_watch_read - read what inotify has queued, noting each entry that
+ * was created, moved in or had its mode changed
+ */
+int forweb_watch_read(struct forweb_watch *watch) {
+    alignas(struct inotify_event) char events[64 * 1024];
+    struct inotify_event *event;
+    ssize_t nread;
+
+    while((nread = read(watch->fd, events, sizeof(events))) > 0) {
+        for(char *ptr = events; ptr < events + nread; ptr += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event *) ptr;
+
+            if(event->mask & IN_Q_OVERFLOW) {
+                // Events were lost, so the whole tree has to be looked at again
+                watch->overflow = true;
+            } else if(event->mask & IN_IGNORED) {
+                // The directory is gone, and its watch with it
+                watch->paths.erase(event->wd);
+            } else if(event->len > 0) {
+                watch->pending[make_pair(event->wd, string(event->name))] |= event->mask;
+            }
+        }
+    }
+
+    return nread < 0 && errno != EAGAIN && errno != EINTR ? -1 : 0;
+}
+
+/*
+ * forweb_watch_flush - give every entry named since the last flush its
+ * permissions, and walk and watch any directory that appeared
+ */
+void forweb_watch_flush(struct forweb_watch *watch, struct forweb_run *run, char *buf, size_t buf_len) {
+    map<pair<int, string>, uint32_t>::iterator iterator;
+    unordered_map<int, string>::iterator watched;
+    struct stat file_stat;
+    struct forweb_tally tally = {};
+    string dir_path;
+    int dir_fd = -1, dir_wd = -1, sub_fd;
+
+    // Each flush is a walk of its own, free to go back through directories
+    for(int i = 0; i < INODE_SET_SHARDS; i++) {
+        run->seen->shards[i].clear();
+    }
+
+    if(watch->overflow) {
+        watch->overflow = false;
+        watch->pending.clear();
+        if((dir_fd = open(run->path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+            string path = run->path;
+            forweb_worker(dir_fd, 0, &path, run, buf, buf_len, NULL);
+        }
+        return;
+    }
+
+    // Entries are ordered by watch, so each directory is opened once
+    for(iterator = watch->pending.begin(); iterator != watch->pending.end(); iterator++) {
+        int wd = iterator->first.first;
+        const char *name = iterator->first.second.c_str();
+
+        if(wd != dir_wd) {
+            if(dir_fd >= 0) {
+                close(dir_fd);
+            }
+            dir_wd = wd;
+            dir_fd = -1;
+            if((watched = watch->paths.find(wd)) != watch->paths.end()) {
+                dir_path = watched->second;
+                dir_fd = open(dir_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            }
+        }
+
+        if(dir_fd < 0 || fstatat(dir_fd, name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0 || !forweb_admit(run, &file_stat)) {
+            continue;
+        }
+
+        tally.entries++;
+        forweb_apply(dir_fd, name, &file_stat, run, &tally);
+
+        // A new directory may have been filled before its watch was in place
+        if(S_ISDIR(file_stat.st_mode) && (iterator->second & (IN_CREATE | IN_MOVED_TO)) &&
+           (sub_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) >= 0) {
+            string path = dir_path + "/" + name;
+            forweb_worker(sub_fd, 1, &path, run, buf, buf_len, NULL);
+        }
+    }
+
+    if(dir_fd >= 0) {
+        close(dir_fd);
+    }
+    forweb_tally_add(run, &tally);
+    watch->pending.clear();
+}
+
+/*
+ * prune_dir - delete every empty file under a directory, or with filters
+ * every file they pick, walking it with a pool of threads: one unless -j asks
+ * for more. With -d, directories left empty go too, each as soon as its
+ * subtree is done, so one pass does it all. -n only lists what would go, and
+ * --log FILE appends a record of everything that went to FILE.
+ */
+int prune_dir(char *argv[]) {
+    struct prune_opts opts;
+    struct prune_run run;
+    struct walk_ctx ctx;
+    struct timespec start, end;
+    list<walk_dir *> roots;
+    char *dir_name = (char *) ".";
+    double seconds;
+
+    if(parse_prune_opts(argv, &opts, &dir_name) != 0) {
+        return 2;
+    }
+
+    run.opts = &opts;
+    run.error = 0;
+    run.log_fd = -1;
+    run.entries = 0;
+    run.deleted = 0;
+    run.bytes = 0;
+    run.removed = 0;
+    run.failures = 0;
+
+    // The log is only ever added to, a whole batch of records at a time
+    if(opts.log != NULL && !opts.dry_run
+       && (run.log_fd = open(opts.log, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        fprintf(stderr, "%s%s%s%s\n", "prunedir: cannot open log '", opts.log, "': ", strerror(errno));
+        return 2;
+    }
+
+    walk_dir *root = new walk_dir();
+    root->name = dir_name;
+    root->data = &run;
+    roots.push_back(root);
+
+    progress_start("prunedir", dir_name);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Every directory is kept until its subtree is done, which lets -d
+    // remove it then and gives walk_path every entry's path. Only -d needs
+    // the fds kept too, to remove each directory from its parent. Workers
+    // write their listings straight to fd 1.
+    fflush(stdout);
+    ctx.visit = prune_visit;
+    ctx.leave = prune_leave;
+    ctx.keep_fds = opts.rmdirs;
+    ctx.arg = &run;
+    walk_start(&ctx, &roots, opts.threads > 0 ? opts.threads : 1);
+    walk_finish(&ctx);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    progress_stop();
+
+    if(run.log_fd >= 0) {
+        close(run.log_fd);
+    }
+
+    // Check if the directory exists
+    if(run.error != 0) {
+        fprintf(stderr, "%s%s%s\n", "prunedir: cannot access '", dir_name, "': No such directory");
+        return 2;
+    }
+
+    if(builtin_cancelled) {
+        return 1;
+    }
+
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    prune_report(&opts, &run, seconds);
+
+    return run.failures > 0 ? 1 : 0;
+}
+
+/*
+ * prune_report - for a dry or parallel run, print how many files and bytes
+ * went or would go, and for a parallel one how fast entries went by
+ */
+void prune_report(struct prune_opts *opts, struct prune_run *run, double seconds) {
+    if(!opts->dry_run && opts->threads <= 0) {
+        return;
+    }
+
+    fprintf(stdout, "prunedir: %lu entries examined, %lu %s (%llu bytes)", run->entries.load(),
+            run->deleted.load(), opts->dry_run ? "would be deleted" : "deleted", run->bytes.load());
+    if(opts->rmdirs) {
+        fprintf(stdout, ", %lu directories %s", run->removed.load(), opts->dry_run ? "would be removed" : "removed");
+    }
+    if(opts->threads > 0) {
+        fprintf(stdout, " in %.3f s with %d threads (%.0f entries/s)",
+                seconds, opts->threads, seconds > 0 ? run->entries / seconds : 0.0);
+    }
+    fprintf(stdout, "\n");
+}
+
+/*
+ * parse_prune_opts - split the arguments of prunedir into option flags and
+ * the directory to work on
+ */
+int parse_prune_opts(char *argv[], struct prune_opts *opts, char **dir_name) {
+    time_t age;
+
+    opts->threads = 0;
+    opts->rmdirs = false;
+    opts->dry_run = false;
+    opts->log = NULL;
+    opts->filtered = false;
+    opts->older = 0;
+    opts->larger = -1;
+    opts->smaller = -1;
+
+    for(int i = 1; argv[i] != NULL; i++) {
+        // Anything that isn't a flag is the directory
+        if(argv[i][0] != '-' || argv[i][1] == '\0') {
+            *dir_name = argv[i];
+            continue;
+        }
+
+        if(!strncmp(argv[i], "-j", 2)) {
+            if(parse_threads("prunedir", argv, &i, &opts->threads)) {
+                return 1;
+            }
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-d")) {
+            // Also remove the directories that end up empty
+            opts->rmdirs = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-n")) {
+            // Dry run: list what would be deleted, and delete nothing
+            opts->dry_run = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "--log")) {
+            // --log FILE: append a record of each deletion to FILE
+            if(argv[i + 1] == NULL) {
+                fprintf(stderr, "%s\n", "prunedir: option requires an argument -- 'log'");
+                return 1;
+            }
+            opts->log = argv[++i];
+            continue;
+        }
+
+        // The filters all take a value
+        if(!strcmp(argv[i], "--older") || !strcmp(argv[i], "--larger") || !strcmp(argv[i], "--smaller")
+           || !strcmp(argv[i], "--include") || !strcmp(argv[i], "--exclude")) {
+            char *flag = argv[i], *value = argv[i + 1];
+
+            if(value == NULL) {
+                fprintf(stderr, "%s%s%s\n", "prunedir: option requires an argument -- '", &flag[2], "'");
+                return 1;
+            }
+            i++;
+            opts->filtered = true;
+
+            if(!strcmp(flag, "--older")) {
+                // --older N[smhdw]: last modified more than N (days) ago
+                if(prune_parse_age(value, &age) != 0) {
+                    fprintf(stderr, "%s%s%s\n", "prunedir: invalid age '", value, "'");
+                    return 1;
+                }
+                opts->older = time(NULL) - age;
+            } else if(!strcmp(flag, "--larger") || !strcmp(flag, "--smaller")) {
+                // --larger N[kMGT], --smaller N[kMGT]: sizes in bytes
+                if(prune_parse_size(value, !strcmp(flag, "--larger") ? &opts->larger : &opts->smaller) != 0) {
+                    fprintf(stderr, "%s%s%s\n", "prunedir: invalid size '", value, "'");
+                    return 1;
+                }
+            } else {
+                glob_pattern glob;
+                glob_compile(value, &glob);
+                (!strcmp(flag, "--include") ? opts->include : opts->exclude).push_back(glob);
+            }
+            continue;
+        }
+
+        fprintf(stderr, "%s%s%s\n", "prunedir: invalid option -- '", &argv[i][1], "'");
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * prune_visit - walker callback for prunedir: queue a directory's
+ * subdirectories and delete the files it wants. Files are only stat-ed when
+ * getdents says they are regular or doesn't know, and once their names have
+ * passed the globs; the ones picked in a getdents batch are unlinked together
+ * before the next batch is read. Symlinks are neither followed nor deleted.
+ */
+void prune_visit(struct walk_worker *worker, struct walk_dir *dir) {
+    struct prune_run *run = (struct prune_run *) worker->ctx->arg;
+    struct dent_reader reader;
+    struct dirent64 *directory_entry;
+    struct stat file_stat;
+    vector<pair<const char *, off_t> > batch;
+    unsigned long entries = 0, deleted = 0;
+    string path;
+
+    if(dir->fd < 0) {
+        if(dir->depth == 0 && dir->error != ECANCELED) {
+            run->error = dir->error;
+        } else if(dir->depth > 0 && dir->error != ELOOP && dir->error != ECANCELED) {
+            walk_path(dir->parent, &path);
+            fprintf(stderr, "%s%s%s%s%s\n", "prunedir: cannot access '", path.c_str(), dir->name.c_str(), "': ", strerror(dir->error));
+            run->failures++;
+        }
+        return;
+    }
+
+    dent_open(&reader, dir->fd, worker->buf, sizeof(worker->buf));
+    while(!builtin_cancelled) {
+        // The batch names point into the buffer, so go through them before it is refilled
+        if(!dent_buffered(&reader)) {
+            prune_unlink(dir, &batch, run, &deleted);
+        }
+        if((directory_entry = dent_next(&reader)) == NULL) {
+            break;
+        }
+        entries++;
+
+        if(directory_entry->d_type == DT_DIR) {
+            walk_push(worker, dir, directory_entry->d_name, run);
+            continue;
+        }
+        if(directory_entry->d_type != DT_REG && directory_entry->d_type != DT_UNKNOWN) {
+            continue;
+        }
+
+        // Only a filesystem without d_type makes an entry the globs turned
+        // down need a stat, to find out whether it is a directory
+        if(!prune_wanted_name(run->opts, directory_entry->d_name) && directory_entry->d_type == DT_REG) {
+            continue;
+        }
+
+        if(fstatat(dir->fd, directory_entry->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+
+        if(S_ISDIR(file_stat.st_mode)) {
+            walk_push(worker, dir, directory_entry->d_name, run);
+        } else if(prune_wanted(run->opts, &file_stat) && prune_wanted_name(run->opts, directory_entry->d_name)) {
+            batch.push_back(make_pair(directory_entry->d_name, file_stat.st_size));
+        }
+    }
+    prune_unlink(dir, &batch, run, &deleted);
+
+    // What is left here, less the subdirectories that get removed later
+    dir->count += entries - deleted;
+    run->entries += entries;
+    progress_add(entries);
+}
+
+/*
+ * prune_leave - walker callback for prunedir, once a directory's subtree is
+ * done: with -d, remove the directory if nothing is left in it. The root is
+ * kept, as is anything an interrupted run might not have seen all of.
+ */
+void prune_leave(struct walk_worker *worker, struct walk_dir *dir) {
+    struct prune_run *run = (struct prune_run *) worker->ctx->arg;
+    struct out_buf out;
+    char stamp[32];
+    string path;
+
+    if(!run->opts->rmdirs || dir->depth == 0 || dir->error != 0 || dir->count != 0 || builtin_cancelled) {
+        return;
+    }
+
+    walk_path(dir->parent, &path);
+    if(run->opts->dry_run) {
+        out_printf(&out, "%s%s/\n", path.c_str(), dir->name.c_str());
+        out_write(&out, STDOUT_FILENO);
+    } else if(unlinkat(dir->parent->fd, dir->name.c_str(), AT_REMOVEDIR) != 0) {
+        // Something created in it since it was read is not an error
+        if(errno != ENOENT && errno != ENOTEMPTY) {
+            fprintf(stderr, "%s%s%s%s%s\n", "prunedir: cannot remove '", path.c_str(), dir->name.c_str(), "': ", strerror(errno));
+            run->failures++;
+        }
+        return;
+    } else if(run->log_fd >= 0) {
+        prune_stamp(stamp, sizeof(stamp));
+        prune_log(&out, stamp, "rmdir", 0, &path, dir->name.c_str());
+        prune_log_write(run, &out);
+    }
+
+    dir->parent->count--;
+    run->removed++;
+}
+
+/*
+ * prune_unlink - delete the files named in batch, with their sizes, from the
+ * directory, adding how many went to deleted, and empty the batch. A dry run
+ * lists them instead; otherwise the ones deleted are logged, if there is a
+ * log. Either way that is one write for the whole batch.
+ */
+void prune_unlink(struct walk_dir *dir, vector<pair<const char *, off_t> > *batch, struct prune_run *run, unsigned long *deleted) {
+    vector<pair<const char *, off_t> >::iterator iterator;
+    struct out_buf out;
+    unsigned long unlinked = 0;
+    unsigned long long bytes = 0;
+    char stamp[32];
+    string path;
+
+    if(batch->empty()) {
+        return;
+    }
+    walk_path(dir, &path);
+    prune_stamp(stamp, sizeof(stamp));
+
+    for(iterator = batch->begin(); iterator != batch->end(); iterator++) {
+        if(run->opts->dry_run) {
+            out_printf(&out, "%s%s\n", path.c_str(), iterator->first);
+        } else if(unlinkat(dir->fd, iterator->first, 0) != 0) {
+            if(errno != ENOENT) {
+                fprintf(stderr, "%s%s%s%s%s\n", "prunedir: cannot delete '", path.c_str(), iterator->first, "': ", strerror(errno));
+                run->failures++;
+            }
+            continue;
+        } else if(run->log_fd >= 0) {
+            prune_log(&out, stamp, "unlink", iterator->second, &path, iterator->first);
+        }
+
+        unlinked++;
+        bytes += iterator->second;
+    }
+
+    if(run->opts->dry_run) {
+        out_write(&out, STDOUT_FILENO);
+    } else if(run->log_fd >= 0) {
+        prune_log_write(run, &out);
+    }
+
+    run->deleted += unlinked;
+    run->bytes += bytes;
+    *deleted += unlinked;
+    batch->clear();
+}
+
+/*
+ * prune_log - add a record to out for the audit log: when, what was done,
+ * the size and the path, tab-separated, one line per entry. Tabs, newlines
+ * and backslashes in names are written as \t, \n and \\.
+ */
+void prune_log(struct out_buf *out, const char *stamp, const char *op, off_t size, string *dir_path, const char *name) {
+    string full = *dir_path + name;
+
+    out_printf(out, "%s\t%s\t%lld\t", stamp, op, (long long) size);
+
+    for(size_t i = 0; i < full.size(); i++) {
+        switch(full[i]) {
+            case '\t': out->text.append("\\t"); break;
+            case '\n': out->text.append("\\n"); break;
+            case '\\': out->text.append("\\\\"); break;
+            default: out->text.push_back(full[i]);
+        }
+    }
+    out->text.push_back('\n');
+}
+
+/*
+ * prune_stamp - the time now in UTC, as the audit log records it; one
+ * stamp serves a whole batch
+ */
+void prune_stamp(char *stamp, size_t len) {
+    struct tm tm;
+    time_t now = time(NULL);
+
+    strftime(stamp, len, "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&now, &tm));
+}
+
+/*
+ * prune_log_write - append the records gathered in out to the audit log with
+ * one write, which O_APPEND keeps whole against other threads' records
+ */
+void prune_log_write(struct prune_run *run, struct out_buf *out) {
+    if(out_write(out, run->log_fd) != 0) {
+        fprintf(stderr, "%s%s%s%s\n", "prunedir: cannot write log '", run->opts->log, "': ", strerror(errno));
+        run->failures++;
+    }
+}
+
+/*
+ * prune_wanted_name - whether a file's name passes the include and exclude
+ * globs: at least one include, if there are any, and no exclude
+ */
+bool prune_wanted_name(struct prune_opts *opts, const char *name) {
+    vector<glob_pattern>::iterator iterator;
+    bool included = opts->include.empty();
+
+    for(iterator = opts->include.begin(); !included && iterator != opts->include.end(); iterator++) {
+        included = glob_match(&*iterator, name);
+    }
+    if(!included) {
+        return false;
+    }
+
+    for(iterator = opts->exclude.begin(); iterator != opts->exclude.end(); iterator++) {
+        if(glob_match(&*iterator, name)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * prune_wanted - whether a file is one to delete, going by its stat: an empty
+ * regular file, or with filters a regular file within their size and age
+ */
+bool prune_wanted(struct prune_opts *opts, struct stat *file_stat) {
+    if(!S_ISREG(file_stat->st_mode)) {
+        return false;
+    }
+    if(!opts->filtered) {
+        return file_stat->st_size == 0;
+    }
+
+    if(opts->larger >= 0 && file_stat->st_size <= opts->larger) {
+        return false;
+    }
+    if(opts->smaller >= 0 && file_stat->st_size >= opts->smaller) {
+        return false;
+    }
+    if(opts->older != 0 && file_stat->st_mtime >= opts->older) {
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * prune_parse_size - read a size in bytes, with an optional k, M, G or T
+ * for powers of 1024. A size too big to hold in bytes is refused.
+ */
+int prune_parse_size(const char *text, long long *bytes) {
+    const char *units = "kMGT";
+    const char *unit;
+    char *end;
+    int shift;
+
+    errno = 0;
+    *bytes = strtoll(text, &end, 10);
+    if(errno != 0 || end == text || *bytes < 0) {
+        return -1;
+    }
+
+    if(*end != '\0') {
+        if(end[1] != '\0' || (unit = strchr(units, *end)) == NULL) {
+            return -1;
+        }
+        shift = 10 * (unit - units + 1);
+        if(*bytes > (LLONG_MAX >> shift)) {
+            return -1;
+        }
+        *bytes <<= shift;
+    }
+
+    return 0;
+}
+
+/*
+ * prune_parse_age - read an age in seconds from a number of days, or of
+ * seconds, minutes, hours, days or weeks given by an s, m, h, d or w. An
+ * age too long to hold in seconds is refused.
+ */
+int prune_parse_age(const char *text, time_t *seconds) {
+    char *end;
+    long long count, multiplier;
+
+    errno = 0;
+    count = strtoll(text, &end, 10);
+    if(errno != 0 || end == text || count < 0 || (*end != '\0' && end[1] != '\0')) {
+        return -1;
+    }
+
+    switch(*end) {
+        case 's': multiplier = 1; break;
+        case 'm': multiplier = 60; break;
+        case 'h': multiplier = 60 * 60; break;
+        case '\0':
+        case 'd': multiplier = 60 * 60 * 24; break;
+        case 'w': multiplier = 60 * 60 * 24 * 7; break;
+        default: return -1;
+    }
+
+    if(count > LLONG_MAX / multiplier) {
+        return -1;
+    }
+    *seconds = count * multiplier;
+
+    return 0;
+}
+
+/*
+ * myfind - print the paths under each directory that match an expression,
+ * like find(1) without its actions. Each directory is read on whichever
+ * walker thread gets to it, with -j N setting how many there are; by default
+ * one per core. Nothing is stat-ed unless a test needs it.
+ */
+int myfind(char *argv[]) {
+    struct find_opts opts;
+    struct find_run run;
+    struct walk_ctx ctx;
+    list<walk_dir *> roots;
+    list<char *>::iterator iterator;
+
+    if(parse_find_opts(argv, &opts) != 0) {
+        return 1;
+    }
+
+    run.opts = &opts;
+    run.failures = 0;
+
+    for(iterator = opts.roots.begin(); iterator != opts.roots.end(); iterator++) {
+        walk_dir *root = new walk_dir();
+        root->name = *iterator;
+        root->data = &run;
+        roots.push_back(root);
+    }
+
+    // Parents are kept for walk_path, and workers write straight to fd 1
+    progress_start("myfind", opts.roots.front());
+    fflush(stdout);
+    ctx.visit = find_visit;
+    ctx.keep_parents = true;
+    ctx.arg = &run;
+    walk_start(&ctx, &roots, opts.threads);
+    walk_finish(&ctx);
+    progress_stop();
+
+    return run.failures > 0 || builtin_cancelled ? 1 : 0;
+}
+
+/*
+ * parse_find_opts - take -j from the front of the arguments, then the
+ * directories up to the first test, then compile the expression
+ */
+int parse_find_opts(char *argv[], struct find_opts *opts) {
+    int i = 1;
+
+    opts->threads = walk_threads();
+    opts->now = time(NULL);
+
+    if(argv[i] != NULL && !strncmp(argv[i], "-j", 2)) {
+        if(parse_threads("myfind", argv, &i, &opts->threads)) {
+            return 1;
+        }
+        i++;
+    }
+
+    for(; argv[i] != NULL && argv[i][0] != '-' && strcmp(argv[i], "!"); i++) {
+        opts->roots.push_back(argv[i]);
+    }
+    if(opts->roots.empty()) {
+        opts->roots.push_back((char *) ".");
+    }
+
+    return find_compile(&argv[i], opts);
+}
+
+/*
+ * find_compile - compile an expression of tests into opts->program. Tests
+ * next to each other must all hold, -o between them means either side may,
+ * and ! or -not before a test turns it around. Each run of tests joined by
+ * and is put in order of cost, since none has side effects: names, then
+ * types, then whatever needs a stat. A test that fails jumps to the next
+ * run, and getting through a run is a match.
+ */
+int find_compile(char *argv[], struct find_opts *opts) {
+    vector<find_op> *program = &opts->program;
+    size_t run_start = 0;
+    bool negate = false;
+    find_op op;
+
+    for(char **args = argv; ; args++) {
+        if(*args != NULL && (!strcmp(*args, "!") || !strcmp(*args, "-not"))) {
+            negate = !negate;
+            continue;
+        }
+
+        if(*args != NULL && strcmp(*args, "-o") && strcmp(*args, "-or") && strcmp(*args, "-a") && strcmp(*args, "-and")) {
+            if(find_parse_test(&args, &op, opts) != 0) {
+                return 1;
+            }
+            op.negate = negate;
+            negate = false;
+            program->push_back(op);
+            continue;
+        }
+
+        // -a is what two tests side by side mean anyway
+        if(*args != NULL && (!strcmp(*args, "-a") || !strcmp(*args, "-and"))) {
+            continue;
+        }
+
+        if(negate || (program->size() == run_start && (*args != NULL || run_start > 0))) {
+            fprintf(stderr, "%s\n", "myfind: expected a test");
+            return 1;
+        }
+
+        // The end of a run: cheapest tests first, then the match
+        stable_sort(program->begin() + run_start, program->end(),
+                    [](const find_op &a, const find_op &b) { return min(a.code, FIND_SIZE) < min(b.code, FIND_SIZE); });
+        op.code = FIND_MATCH;
+        op.negate = false;
+        program->push_back(op);
+
+        for(size_t i = run_start; i < program->size() - 1; i++) {
+            (*program)[i].fail = program->size();
+        }
+        run_start = program->size();
+
+        if(*args == NULL) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * find_parse_test - compile the test at **args into op, moving *args onto
+ * its last argument
+ */
+int find_parse_test(char ***args, struct find_op *op, struct find_opts *opts) {
+    static const char *types = "fdlpscb";
+    static const mode_t modes[] = { S_IFREG, S_IFDIR, S_IFLNK, S_IFIFO, S_IFSOCK, S_IFCHR, S_IFBLK };
+    static const unsigned char d_types[] = { DT_REG, DT_DIR, DT_LNK, DT_FIFO, DT_SOCK, DT_CHR, DT_BLK };
+    char *test = **args, *value = (*args)[1];
+    const char *type;
+    struct stat ref_stat;
+
+    if(strcmp(test, "-name") && strcmp(test, "-type") && strcmp(test, "-size") && strcmp(test, "-mtime") && strcmp(test, "-newer")) {
+        fprintf(stderr, "%s%s%s\n", "myfind: unknown predicate '", test, "'");
+        return 1;
+    }
+    if(value == NULL) {
+        fprintf(stderr, "%s%s%s\n", "myfind: missing argument to '", test, "'");
+        return 1;
+    }
+    (*args)++;
+
+    if(!strcmp(test, "-name")) {
+        op->code = FIND_NAME;
+        glob_compile(value, &op->glob);
+    } else if(!strcmp(test, "-type")) {
+        if(value[0] == '\0' || value[1] != '\0' || (type = strchr(types, value[0])) == NULL) {
+            fprintf(stderr, "%s%s%s\n", "myfind: unknown argument to -type: '", value, "'");
+            return 1;
+        }
+        op->code = FIND_TYPE;
+        op->mode = modes[type - types];
+        op->d_type = d_types[type - types];
+    } else if(!strcmp(test, "-size")) {
+        op->code = FIND_SIZE;
+        if(find_parse_count(value, op, true) != 0) {
+            fprintf(stderr, "%s%s%s\n", "myfind: invalid -size '", value, "'");
+            return 1;
+        }
+    } else if(!strcmp(test, "-mtime")) {
+        op->code = FIND_MTIME;
+        if(find_parse_count(value, op, false) != 0) {
+            fprintf(stderr, "%s%s%s\n", "myfind: invalid -mtime '", value, "'");
+            return 1;
+        }
+        op->time.tv_sec = opts->now;
+    } else {
+        // The reference file is looked at once, here
+        if(lstat(value, &ref_stat) != 0) {
+            fprintf(stderr, "%s%s%s%s\n", "myfind: cannot access '", value, "': ", strerror(errno));
+            return 1;
+        }
+        op->code = FIND_NEWER;
+        op->time = ref_stat.st_mtim;
+    }
+
+    return 0;
+}
+
+/*
+ * find_parse_count - read [+-]N for -size or -mtime. Sizes take a unit of
+ * c (bytes), w (2 bytes), b (512 bytes, the default), k, M or G.
+ */
+int find_parse_count(const char *text, struct find_op *op, bool units) {
+    char *end;
+
+    op->cmp = text[0] == '+' ? 1 : text[0] == '-' ? -1 : 0;
+    if(op->cmp != 0) {
+        text++;
+    }
+    if(text[0] < '0' || text[0] > '9') {
+        return -1;
+    }
+
+    errno = 0;
+    op->n = strtoll(text, &end, 10);
+    op->unit = units ? 512 : 1;
+    if(errno != 0) {
+        return -1;
+    }
+
+    if(units && *end != '\0' && end[1] == '\0') {
+        switch(*end++) {
+            case 'c': op->unit = 1; break;
+            case 'w': op->unit = 2; break;
+            case 'b': op->unit = 512; break;
+            case 'k': op->unit = 1024LL; break;
+            case 'M': op->unit = 1024LL * 1024; break;
+            case 'G': op->unit = 1024LL * 1024 * 1024; break;
+            default: return -1;
+        }
+    }
+
+    return *end == '\0' ? 0 : -1;
+}
+
+/*
+ * find_eval - run a compiled expression over an entry
+ */
+bool find_eval(vector<find_op> *program, struct find_entry *entry) {
+    size_t pc = 0;
+
+    while(pc < program->size()) {
+        find_op *op = &(*program)[pc];
+
+        if(op->code == FIND_MATCH) {
+            return true;
+        }
+        pc = find_test(op, entry) != op->negate ? pc + 1 : op->fail;
+    }
+
+    return false;
+}
+
+/*
+ * find_test - whether a single test holds for an entry, before any negation.
+ * -size and -mtime round up and down like find(1): sizes to whole units,
+ * ages to whole days.
+ */
+bool find_test(struct find_op *op, struct find_entry *entry) {
+    struct stat *file_stat;
+    long long count;
+
+    if(op->code == FIND_NAME) {
+        return glob_match(&op->glob, entry->name);
+    }
+    if(op->code == FIND_TYPE && entry->d_type != DT_UNKNOWN) {
+        return entry->d_type == op->d_type;
+    }
+
+    // Everything else needs the entry's metadata
+    if((file_stat = find_stat(entry)) == NULL) {
+        return false;
+    }
+
+    switch(op->code) {
+        case FIND_TYPE:
+            return (file_stat->st_mode & S_IFMT) == op->mode;
+        case FIND_SIZE:
+            count = (file_stat->st_size + op->unit - 1) / op->unit;
+            break;
+        case FIND_MTIME:
+            count = (op->time.tv_sec - file_stat->st_mtime) / (24 * 60 * 60);
+            break;
+        default:
+            return file_stat->st_mtim.tv_sec > op->time.tv_sec
+                   || (file_stat->st_mtim.tv_sec == op->time.tv_sec && file_stat->st_mtim.tv_nsec > op->time.tv_nsec);
+    }
+
+    return op->cmp < 0 ? count < op->n : op->cmp > 0 ? count > op->n : count == op->n;
+}
+
+/*
+ * find_stat - lstat an entry the first time a test asks, or NULL if it can't be
+ */
+struct stat *find_stat(struct find_entry *entry) {
+    if(!entry->stated) {
+        entry->stated = true;
+        entry->stat_failed = fstatat(entry->dir_fd, entry->name, &entry->file_stat, AT_SYMLINK_NOFOLLOW) != 0;
+    }
+
+    return entry->stat_failed ? NULL : &entry->file_stat;
+}
+
+/*
+ * find_visit - walker callback for myfind: test and print a directory's
+ * entries, gathering the output so it goes out in large writes, and queue
+ * its subdirectories. A root is tested itself before its entries are.
+ */
+void find_visit(struct walk_worker *worker, struct walk_dir *dir) {
+    struct find_run *run = (struct find_run *) worker->ctx->arg;
+    struct dent_reader reader;
+    struct dirent64 *directory_entry;
+    struct find_entry entry;
+    struct out_buf out;
+    unsigned long entries = 0;
+    string path;
+
+    if(dir->fd < 0) {
+        if(dir->depth == 0 && dir->error == ENOTDIR) {
+            // A file named on the command line is tested on its own
+            find_root_file(run, (char *) dir->name.c_str());
+        } else if(dir->error != ELOOP && dir->error != ECANCELED) {
+            walk_path(dir->parent, &path);
+            fprintf(stderr, "%s%s%s%s%s\n", "myfind: cannot access '", path.c_str(), dir->name.c_str(), "': ", strerror(dir->error));
+            run->failures++;
+        }
+        return;
+    }
+
+    walk_path(dir, &path);
+
+    if(dir->depth == 0) {
+        const char *slash = strrchr(dir->name.c_str(), '/');
+
+        entry.dir_fd = dir->fd;
+        entry.name = slash != NULL && slash[1] != '\0' ? slash + 1 : dir->name.c_str();
+        entry.d_type = DT_DIR;
+        entry.stated = true;
+        entry.stat_failed = fstat(dir->fd, &entry.file_stat) != 0;
+        if(find_eval(&run->opts->program, &entry)) {
+            out_printf(&out, "%s\n", dir->name.c_str());
+        }
+    }
+
+    dent_open(&reader, dir->fd, worker->buf, sizeof(worker->buf));
+    while(!builtin_cancelled && (directory_entry = dent_next(&reader)) != NULL) {
+        entries++;
+        entry.dir_fd = dir->fd;
+        entry.name = directory_entry->d_name;
+        entry.d_type = directory_entry->d_type;
+        entry.stated = false;
+
+        if(find_eval(&run->opts->program, &entry)) {
+            out.text.append(path);
+            out.text.append(directory_entry->d_name);
+            out.text.push_back('\n');
+            if(out.text.size() >= FIND_OUT_FLUSH) {
+                out_write(&out, STDOUT_FILENO);
+            }
+        }
+
+        // Only an entry getdents couldn't give a type for needs a stat to
+        // be known as a directory; symlinks are never followed
+        if(entry.d_type == DT_DIR || (entry.d_type == DT_UNKNOWN && find_stat(&entry) != NULL
+                                      && S_ISDIR(entry.file_stat.st_mode))) {
+            walk_push(worker, dir, directory_entry->d_name, run);
+        }
+    }
+
+    out_write(&out, STDOUT_FILENO);
+    progress_add(entries);
+}
+
+/*
+ * find_root_file - test and print a file given to myfind in place of a directory
+ */
+void find_root_file(struct find_run *run, char *name) {
+    struct find_entry entry;
+    const char *slash = strrchr(name, '/');
+
+    entry.dir_fd = AT_FDCWD;
+    entry.name = name;
+    entry.d_type = DT_UNKNOWN;
+    entry.stated = false;
+
+    if(find_stat(&entry) == NULL) {
+        fprintf(stderr, "%s%s%s%s\n", "myfind: cannot access '", name, "': ", strerror(errno));
+        run->failures++;
+        return;
+    }
+
+    // Tests see the last part of the path as the name
+    entry.name = slash != NULL && slash[1] != '\0' ? slash + 1 : name;
+    if(find_eval(&run->opts->program, &entry)) {
+        fprintf(stdout, "%s\n", name);
+        fflush(stdout);
+    }
+}
+
+/*
+ * mydu - total the space allocated under each directory, counting a file
+ * with several hard links once, and print the largest subtrees found across
+ * all of them followed by each directory's total. The tree is walked in
+ * parallel and totals are passed up as each subtree finishes.
+ */
+int mydu(char *argv[]) {
+    struct du_opts opts;
+    struct du_run run;
+    struct inode_set seen;
+    struct walk_ctx ctx;
+    list<walk_dir *> roots;
+    list<char *>::iterator iterator;
+    vector<du_root *> totals;
+    du_heap largest;
+    char size[32];
+    int retval = 0;
+
+    if(parse_du_opts(argv, &opts) != 0) {
+        return 1;
+    }
+
+    run.opts = &opts;
+    run.seen = &seen;
+    run.heaps.resize(opts.threads);
+    run.failures = 0;
+
+    for(iterator = opts.roots.begin(); iterator != opts.roots.end(); iterator++) {
+        du_root *total = new du_root();
+        total->path = *iterator;
+        total->error = 0;
+        total->total = 0;
+        totals.push_back(total);
+
+        walk_dir *root = new walk_dir();
+        root->name = *iterator;
+        root->data = total;
+        roots.push_back(root);
+    }
+
+    progress_start("mydu", opts.roots.front());
+    ctx.visit = du_visit;
+    ctx.leave = du_leave;
+    ctx.arg = &run;
+    walk_start(&ctx, &roots, opts.threads);
+    walk_finish(&ctx);
+    progress_stop();
+
+    // Totals cut short by ctrl-c would only mislead
+    if(builtin_cancelled) {
+        for(size_t i = 0; i < totals.size(); i++) {
+            delete totals[i];
+        }
+        return 1;
+    }
+
+    // Every thread's heap holds its own top N, so the top N overall are among them
+    for(size_t i = 0; i < run.heaps.size(); i++) {
+        largest.insert(largest.end(), run.heaps[i].begin(), run.heaps[i].end());
+    }
+    sort(largest.begin(), largest.end(), greater<pair<unsigned long long, string> >());
+    if(largest.size() > (size_t) opts.top) {
+        largest.resize(opts.top);
+    }
+
+    for(size_t i = 0; i < largest.size(); i++) {
+        du_size(largest[i].first, opts.human, size, sizeof(size));
+        fprintf(stdout, "%s\t%s\n", size, largest[i].second.c_str());
+    }
+
+    for(size_t i = 0; i < totals.size(); i++) {
+        if(totals[i]->error != 0) {
+            fprintf(stderr, "%s%s%s%s\n", "mydu: cannot access '", totals[i]->path.c_str(), "': ", strerror(totals[i]->error));
+            retval = 1;
+        } else {
+            du_size(totals[i]->total, opts.human, size, sizeof(size));
+            fprintf(stdout, "%s\t%s%s\n", size, totals[i]->path.c_str(), " total");
+        }
+        delete totals[i];
+    }
+
+    return retval != 0 || run.failures > 0 ? 1 : 0;
+}
+
+/*
+ * parse_du_opts - split the arguments of mydu into option flags and the
+ * directories to total
+ */
+int parse_du_opts(char *argv[], struct du_opts *opts) {
+    opts->threads = walk_threads();
+    opts->top = MYDU_TOP;
+    opts->human = false;
+
+    for(int i = 1; argv[i] != NULL; i++) {
+        // Anything that isn't a flag is a directory
+        if(argv[i][0] != '-' || argv[i][1] == '\0') {
+            opts->roots.push_back(argv[i]);
+            continue;
+        }
+
+        if(!strncmp(argv[i], "-j", 2)) {
+            if(parse_threads("mydu", argv, &i, &opts->threads)) {
+                return 1;
+            }
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-n")) {
+            // -n N: how many of the largest subtrees to list
+            if(argv[i + 1] == NULL || atoi(argv[i + 1]) <= 0) {
+                fprintf(stderr, "%s\n", "mydu: option requires a number -- 'n'");
+                return 1;
+            }
+            opts->top = atoi(argv[++i]);
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-h")) {
+            // Sizes as 1.5K, 20M and so on rather than in kilobytes
+            opts->human = true;
+            continue;
+        }
+
+        fprintf(stderr, "%s%s%s\n", "mydu: invalid option -- '", &argv[i][1], "'");
+        return 1;
+    }
+
+    if(opts->roots.empty()) {
+        opts->roots.push_back((char *) ".");
+    }
+
+    return 0;
+}
+
+/*
+ * du_visit - walker callback for mydu: add what one directory and the files
+ * in it take up to its count, and queue its subdirectories
+ */
+void du_visit(struct walk_worker *worker, struct walk_dir *dir) {
+    struct du_run *run = (struct du_run *) worker->ctx->arg;
+    struct dent_reader reader;
+    struct dirent64 *directory_entry;
+    struct stat file_stat;
+    unsigned long entries = 0;
+    unsigned long long allocated = 0;
+    string path;
+
+    if(dir->fd < 0) {
+        if(dir->depth == 0) {
+            ((du_root *) dir->data)->error = dir->error;
+        } else if(dir->error != ELOOP && dir->error != ECANCELED) {
+            walk_path(dir->parent, &path);
+            fprintf(stderr, "%s%s%s%s%s\n", "mydu: cannot access '", path.c_str(), dir->name.c_str(), "': ", strerror(dir->error));
+            run->failures++;
+        }
+        return;
+    }
+
+    // The directory itself
+    if(fstat(dir->fd, &file_stat) == 0) {
+        allocated += (unsigned long long) file_stat.st_blocks * 512;
+    }
+
+    dent_open(&reader, dir->fd, worker->buf, sizeof(worker->buf));
+    while(!builtin_cancelled && (directory_entry = dent_next(&reader)) != NULL) {
+        entries++;
+        if(directory_entry->d_type == DT_DIR) {
+            walk_push(worker, dir, directory_entry->d_name, dir->data);
+            continue;
+        }
+
+        if(fstatat(dir->fd, directory_entry->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+        if(S_ISDIR(file_stat.st_mode)) {
+            walk_push(worker, dir, directory_entry->d_name, dir->data);
+            continue;
+        }
+
+        // Only a file with other links can have been counted already
+        if(file_stat.st_nlink > 1 && !inode_set_insert(run->seen, file_stat.st_dev, file_stat.st_ino)) {
+            continue;
+        }
+        allocated += (unsigned long long) file_stat.st_blocks * 512;
+    }
+
+    dir->count += allocated;
+    progress_add(entries);
+}
+
+/*
+ * du_leave - walker callback for mydu once a directory's subtree is done:
+ * its count is now the total under it, so pass that to its parent, or for a
+ * root keep it, and offer the subtree to this thread's heap of the largest
+ */
+void du_leave(struct walk_worker *worker, struct walk_dir *dir) {
+    struct du_run *run = (struct du_run *) worker->ctx->arg;
+    du_heap *heap = &run->heaps[worker->id];
+    unsigned long long total = dir->count;
+    string path;
+
+    if(dir->depth == 0) {
+        ((du_root *) dir->data)->total = total;
+        return;
+    }
+    dir->parent->count += total;
+
+    if(dir->error != 0 || (heap->size() == (size_t) run->opts->top && total <= heap->front().first)) {
+        return;
+    }
+
+    // Only a subtree that makes the list needs its path
+    walk_path(dir, &path);
+    path.resize(path.size() - 1);
+    if(heap->size() == (size_t) run->opts->top) {
+        pop_heap(heap->begin(), heap->end(), greater<pair<unsigned long long, string> >());
+        heap->pop_back();
+    }
+    heap->push_back(make_pair(total, path));
+    push_heap(heap->begin(), heap->end(), greater<pair<unsigned long long, string> >());
+}
+
+/*
+ * du_size - format a number of bytes as du does: in kilobytes, rounded up,
+ * or with human set in the largest unit that keeps it under 1024, with one
+ * decimal below 10
+ */
+void du_size(unsigned long long bytes, bool human, char *buf, size_t len) {
+    const char *units = "KMGTPE";
+    double value = bytes / 1024.0;
+    int unit = 0;
+
+    if(!human) {
+        snprintf(buf, len, "%llu", (bytes + 1023) / 1024);
+        return;
+    }
+    if(bytes < 1024) {
+        snprintf(buf, len, "%llu", bytes);
+        return;
+    }
+
+    // Round up, as du does, so a size never looks smaller than it is
+    while((value < 10 ? ceil(value * 10) / 10 : ceil(value)) >= 1024 && units[unit + 1] != '\0') {
+        value /= 1024;
+        unit++;
+    }
+
+    if(value < 10) {
+        snprintf(buf, len, "%.1f%c", ceil(value * 10) / 10, units[unit]);
+    } else {
+        snprintf(buf, len, "%.0f%c", ceil(value), units[unit]);
+    }
+}
+
+/*
+ * mycp - copy a file, or with -r a directory tree, without a byte of it
+ * passing through the shell: files are reflinked with FICLONE where the
+ * filesystem shares blocks, or else copied in the kernel by copy_file_range,
+ * or failing that by sendfile. Trees are copied by a pool of walker threads,
+ * one per core unless -j says otherwise.
+ */
+int mycp(char *argv[]) {
+    struct cp_opts opts;
+    struct cp_run run;
+    struct stat source_stat, target_stat;
+    struct timespec start, end;
+    string target;
+    const char *base;
+    int retval;
+
+    if(parse_cp_opts(argv, &opts) != 0) {
+        return 1;
+    }
+
+    if(stat(opts.source, &source_stat) != 0) {
+        fprintf(stderr, "%s%s%s%s\n", "mycp: cannot stat '", opts.source, "': ", strerror(errno));
+        return 1;
+    }
+    if(S_ISDIR(source_stat.st_mode) && !opts.recursive) {
+        fprintf(stderr, "%s%s%s\n", "mycp: -r not specified; omitting directory '", opts.source, "'");
+        return 1;
+    }
+
+    // Copying onto an existing directory puts the copy inside it
+    target = opts.target;
+    if(stat(opts.target, &target_stat) == 0 && S_ISDIR(target_stat.st_mode)) {
+        while(target.size() > 1 && target[target.size() - 1] == '/') {
+            target.resize(target.size() - 1);
+        }
+        string source = opts.source;
+        while(source.size() > 1 && source[source.size() - 1] == '/') {
+            source.resize(source.size() - 1);
+        }
+        base = strrchr(source.c_str(), '/');
+        target = target + "/" + (base != NULL ? base + 1 : source.c_str());
+    }
+    opts.target = (char *) target.c_str();
+
+    // Truncating the target would lose the source
+    if(!S_ISDIR(source_stat.st_mode) && stat(opts.target, &target_stat) == 0
+       && target_stat.st_dev == source_stat.st_dev && target_stat.st_ino == source_stat.st_ino) {
+        fprintf(stderr, "%s%s%s%s%s\n", "mycp: '", opts.source, "' and '", opts.target, "' are the same file");
+        return 1;
+    }
+
+    run.clone = true;
+    run.range = true;
+    run.files = 0;
+    run.dirs = 0;
+    for(int i = 0; i < 4; i++) {
+        run.bytes[i] = 0;
+    }
+    run.failures = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(S_ISDIR(source_stat.st_mode)) {
+        retval = cp_tree(&opts, &run, &source_stat);
+    } else if((retval = cp_file(AT_FDCWD, opts.source, AT_FDCWD, opts.target, true, &run)) != 0) {
+        fprintf(stderr, "%s%s%s%s\n", "mycp: cannot copy '", opts.source, "': ", strerror(errno));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if(retval == 0 && !builtin_cancelled) {
+        cp_report(&opts, &run, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    }
+
+    return retval != 0 || run.failures > 0 || builtin_cancelled ? 1 : 0;
+}
+
+/*
+ * parse_cp_opts - split the arguments of mycp into option flags, the source
+ * and the target
+ */
+int parse_cp_opts(char *argv[], struct cp_opts *opts) {
+    list<char *> paths;
+
+    opts->threads = 0;
+    opts->recursive = false;
+
+    for(int i = 1; argv[i] != NULL; i++) {
+        // Anything that isn't a flag is the source or the target
+        if(argv[i][0] != '-' || argv[i][1] == '\0') {
+            paths.push_back(argv[i]);
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-r") || !strcmp(argv[i], "-R")) {
+            opts->recursive = true;
+            continue;
+        }
+
+        if(!strncmp(argv[i], "-j", 2)) {
+            if(parse_threads("mycp", argv, &i, &opts->threads)) {
+                return 1;
+            }
+            continue;
+        }
+
+        fprintf(stderr, "%s%s%s\n", "mycp: invalid option -- '", &argv[i][1], "'");
+        return 1;
+    }
+
+    if(paths.size() != 2) {
+        fprintf(stderr, "%s\n", "mycp: usage: mycp [-r] [-j N] source target");
+        return 1;
+    }
+    opts->source = paths.front();
+    opts->target = paths.back();
+
+    return 0;
+}
+
+/*
+ * cp_tree - make the top of the copy and walk the source into it. A target
+ * inside the source is refused before anything is made, and the copy is
+ * never walked into should one turn up there anyway.
+ */
+int cp_tree(struct cp_opts *opts, struct cp_run *run, struct stat *source_stat) {
+    struct stat target_stat;
+    struct walk_ctx ctx;
+    list<walk_dir *> roots;
+    char source_real[PATH_MAX], parent_real[PATH_MAX];
+    string parent = opts->target;
+    size_t slash = parent.find_last_of('/'), len;
+
+    parent = slash == string::npos ? "." : slash == 0 ? "/" : parent.substr(0, slash);
+    if(realpath(opts->source, source_real) != NULL && realpath(parent.c_str(), parent_real) != NULL) {
+        len = strlen(source_real);
+        if(!strncmp(parent_real, source_real, len)
+           && (parent_real[len] == '\0' || parent_real[len] == '/' || source_real[len - 1] == '/')) {
+            fprintf(stderr, "%s%s%s%s%s\n", "mycp: cannot copy a directory, '", opts->source, "', into itself, '", opts->target, "'");
+            return 1;
+        }
+    }
+
+    cp_dir *top = new cp_dir();
+
+    // Made writable by the owner until it is filled
+    if(mkdir(opts->target, (source_stat->st_mode & 07777) | S_IRWXU) != 0 && errno != EEXIST) {
+        fprintf(stderr, "%s%s%s%s\n", "mycp: cannot create directory '", opts->target, "': ", strerror(errno));
+        delete top;
+        return 1;
+    }
+    if((top->fd = open(opts->target, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 || fstat(top->fd, &target_stat) != 0) {
+        fprintf(stderr, "%s%s%s%s\n", "mycp: cannot access '", opts->target, "': ", strerror(errno));
+        if(top->fd >= 0) {
+            close(top->fd);
+        }
+        delete top;
+        return 1;
+    }
+    top->mode = source_stat->st_mode;
+    run->target_dev = target_stat.st_dev;
+    run->target_ino = target_stat.st_ino;
+    run->dirs++;
+
+    walk_dir *root = new walk_dir();
+    root->name = opts->source;
+    root->data = top;
+    roots.push_back(root);
+
+    // Parents are kept open for their copies until their subtrees are done
+    progress_start("mycp", opts->source);
+    ctx.visit = cp_visit;
+    ctx.leave = cp_leave;
+    ctx.arg = run;
+    walk_start(&ctx, &roots, opts->threads > 0 ? opts->threads : walk_threads());
+    walk_finish(&ctx);
+    progress_stop();
+
+    return 0;
+}
+
+/*
+ * cp_visit - walker callback for mycp: make the copy of a directory, inside
+ * its parent's copy, and copy its entries into it, queueing subdirectories
+ */
+void cp_visit(struct walk_worker *worker, struct walk_dir *dir) {
+    struct cp_run *run = (struct cp_run *) worker->ctx->arg;
+    struct dent_reader reader;
+    struct dirent64 *directory_entry;
+    struct stat dir_stat;
+    unsigned long entries = 0;
+    int copied;
+    cp_dir *copy;
+    string path;
+
+    if(dir->fd < 0) {
+        if(dir->error != ECANCELED) {
+            walk_path(dir->parent, &path);
+            fprintf(stderr, "%s%s%s%s%s\n", "mycp: cannot access '", path.c_str(), dir->name.c_str(), "': ", strerror(dir->error));
+            run->failures++;
+        }
+        return;
+    }
+
+    if(fstat(dir->fd, &dir_stat) != 0) {
+        return;
+    }
+    if(dir_stat.st_dev == run->target_dev && dir_stat.st_ino == run->target_ino) {
+        fprintf(stderr, "%s\n", "mycp: cannot copy a directory into itself");
+        run->failures++;
+        return;
+    }
+
+    // The top copy was made by cp_tree; every other is made here
+    if(dir->depth > 0) {
+        int parent_fd = ((cp_dir *) dir->parent->data)->fd;
+
+        copy = new cp_dir();
+        copy->mode = dir_stat.st_mode;
+        if((mkdirat(parent_fd, dir->name.c_str(), (dir_stat.st_mode & 07777) | S_IRWXU) != 0 && errno != EEXIST)
+           || (copy->fd = openat(parent_fd, dir->name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+            walk_path(dir, &path);
+            fprintf(stderr, "%s%s%s%s\n", "mycp: cannot create directory copy of '", path.c_str(), "': ", strerror(errno));
+            run->failures++;
+            delete copy;
+            return;
+        }
+        dir->data = copy;
+        run->dirs++;
+    }
+    copy = (cp_dir *) dir->data;
+
+    dent_open(&reader, dir->fd, worker->buf, sizeof(worker->buf));
+    while(!builtin_cancelled && (directory_entry = dent_next(&reader)) != NULL) {
+        entries++;
+
+        if(directory_entry->d_type == DT_DIR) {
+            walk_push(worker, dir, directory_entry->d_name, NULL);
+            continue;
+        }
+
+        if((copied = cp_entry(dir->fd, directory_entry->d_name, directory_entry->d_type, copy->fd, run)) > 0) {
+            walk_push(worker, dir, directory_entry->d_name, NULL);
+        } else if(copied < 0) {
+            walk_path(dir, &path);
+            fprintf(stderr, "%s%s%s%s%s\n", "mycp: cannot copy '", path.c_str(), directory_entry->d_name, "': ", strerror(errno));
+            run->failures++;
+        }
+    }
+
+    progress_add(entries);
+}
+
+/*
+ * cp_leave - walker callback for mycp once a directory's subtree is copied:
+ * give its copy the original's mode, which may not let anything more in
+ */
+void cp_leave(struct walk_worker *, struct walk_dir *dir) {
+    cp_dir *copy = (cp_dir *) dir->data;
+
+    // A directory that couldn't be opened, or whose copy couldn't be made
+    if(copy == NULL) {
+        return;
+    }
+
+    fchmod(copy->fd, copy->mode & 07777);
+    close(copy->fd);
+    delete copy;
+}
+
+/*
+ * cp_entry - copy one entry other than a known directory: a file by its
+ * contents, a symlink as a symlink, a FIFO as a new FIFO. Returns 1 for a
+ * directory getdents didn't say was one, to be queued, 0 once the entry is
+ * copied, or -1 with errno set if it couldn't be.
+ */
+int cp_entry(int src_dir, const char *name, unsigned char d_type, int dst_dir, struct cp_run *run) {
+    struct stat file_stat;
+    char link[PATH_MAX];
+    ssize_t link_len;
+
+    if(d_type == DT_UNKNOWN) {
+        if(fstatat(src_dir, name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0) {
+            return -1;
+        }
+        d_type = IFTODT(file_stat.st_mode);
+    }
+
+    switch(d_type) {
+        case DT_DIR:
+            return 1;
+        case DT_REG:
+            return cp_file(src_dir, name, dst_dir, name, false, run);
+        case DT_LNK:
+            if((link_len = readlinkat(src_dir, name, link, sizeof(link) - 1)) < 0) {
+                return -1;
+            }
+            link[link_len] = '\0';
+            return symlinkat(link, dst_dir, name);
+        case DT_FIFO:
+            if(fstatat(src_dir, name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0) {
+                return -1;
+            }
+            return mkfifoat(dst_dir, name, file_stat.st_mode & 07777);
+        default:
+            // Devices and sockets are not files to copy
+            errno = ENOTSUP;
+            return -1;
+    }
+}
+
+/*
+ * cp_file - copy a regular file, trying FICLONE, then copy_file_range, then
+ * sendfile, then plain reads and writes, each taking up where the one before
+ * stopped. A symlink is only followed when follow is set, as it is for the
+ * source named to mycp; in a tree, links are copied as links. Returns 0, or
+ * -1 with errno set.
+ */
+int cp_file(int src_dir, const char *src_name, int dst_dir, const char *dst_name, bool follow, struct cp_run *run) {
+    struct stat file_stat;
+    off_t in_off = 0, out_off = 0, done[4] = { 0, 0, 0, 0 };
+    char buf[64 * 1024];
+    ssize_t copied;
+    bool eof = false;
+    int in, out, saved;
+
+    if((in = openat(src_dir, src_name, O_RDONLY | (follow ? 0 : O_NOFOLLOW) | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    if(fstat(in, &file_stat) != 0
+       || (out = openat(dst_dir, dst_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, file_stat.st_mode & 07777)) < 0) {
+        saved = errno;
+        close(in);
+        errno = saved;
+        return -1;
+    }
+
+    // A reflink shares the blocks outright. Only a filesystem that can't
+    // clone at all turns it off; EXDEV is just this file on another one.
+    if(run->clone) {
+        if(ioctl(out, FICLONE, in) == 0) {
+            in_off = out_off = file_stat.st_size;
+            done[CP_CLONE] = in_off;
+        } else if(errno == EOPNOTSUPP || errno == ENOTTY || errno == ENOSYS) {
+            run->clone = false;
+        }
+    }
+
+    // Both copies run to end of file rather than to the size stat gave,
+    // which is 0 for files in /proc and too small for a file still growing
+    while(run->range) {
+        if((copied = copy_file_range(in, &in_off, out, &out_off, CP_CHUNK, 0)) > 0) {
+            done[CP_RANGE] += copied;
+            continue;
+        }
+        if(copied == 0) {
+            // Some kernels claim end of file at once for /proc files, so an
+            // empty copy is left for sendfile to confirm
+            eof = in_off > 0;
+            break;
+        }
+        if(errno == EINTR) {
+            continue;
+        }
+        if(errno == ENOSYS || errno == EOPNOTSUPP) {
+            run->range = false;
+            break;
+        }
+        if(errno == EXDEV || errno == EINVAL) {
+            // Another filesystem, or a file it won't take: only this one falls back
+            break;
+        }
+        goto fail;
+    }
+
+    // sendfile writes at the file position, so bring it up to what is done
+    if(!eof && lseek(out, out_off, SEEK_SET) < 0) {
+        goto fail;
+    }
+    while(!eof) {
+        if((copied = sendfile(out, in, &in_off, CP_CHUNK)) > 0) {
+            done[CP_SEND] += copied;
+            continue;
+        }
+        if(copied == 0) {
+            eof = true;
+            break;
+        }
+        if(errno == EINTR) {
+            continue;
+        }
+        if(errno == EINVAL || errno == ENOSYS) {
+            break;
+        }
+        goto fail;
+    }
+
+    // Some files in /proc can't be read by sendfile either, so what is
+    // left goes through a buffer
+    while(!eof) {
+        if((copied = pread(in, buf, sizeof(buf), in_off)) > 0) {
+            if(write_all(out, buf, copied) != 0) {
+                goto fail;
+            }
+            in_off += copied;
+            done[CP_READ] += copied;
+            continue;
+        }
+        if(copied == 0) {
+            break;
+        }
+        if(errno != EINTR) {
+            goto fail;
+        }
+    }
+
+    close(in);
+    if(close(out) != 0) {
+        return -1;
+    }
+    run->files++;
+    for(int i = 0; i < 4; i++) {
+        run->bytes[i] += done[i];
+    }
+    return 0;
+
+fail:
+    saved = errno;
+    close(in);
+    close(out);
+    errno = saved;
+    return -1;
+}
+
+/*
+ * cp_report - with -j, print what was copied, how many bytes went each way,
+ * and how fast
+ */
+void cp_report(struct cp_opts *opts, struct cp_run *run, double seconds) {
+    if(opts->threads <= 0) {
+        return;
+    }
+
+    unsigned long long bytes = run->bytes[CP_CLONE] + run->bytes[CP_RANGE] + run->bytes[CP_SEND] + run->bytes[CP_READ];
+
+    fprintf(stdout, "mycp: %lu files, %lu directories, %llu bytes (%llu reflinked, %llu by copy_file_range, %llu by sendfile,"
+            " %llu by read) in %.3f s with %d threads (%.1f MB/s)\n",
+            run->files.load(), run->dirs.load(), bytes, run->bytes[CP_CLONE].load(), run->bytes[CP_RANGE].load(),
+            run->bytes[CP_SEND].load(), run->bytes[CP_READ].load(), seconds, opts->threads,
+            seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+}
+
+/*
+ * glob_compile - turn a shell glob into the steps that match it: runs of
+ * literal text, ?, * and [...] classes, with [!...] or [^...] for the
+ * characters not listed, ranges like a-z, and \ to take the next character
+ * literally. A [ with no closing ] is just a character.
+ */
+void glob_compile(const char *pattern, struct glob_pattern *glob) {
+    const unsigned char *p = (const unsigned char *) pattern;
+    const unsigned char *first, *close;
+    vector<glob_op>::iterator iterator;
+    glob_op op;
+
+    glob->ops.clear();
+    while(*p != '\0') {
+        op.kind = GLOB_LITERAL;
+        op.text.clear();
+
+        // A ] straight after the [ is one of the characters, not the end
+        first = p + 1 + (p[1] == '!' || p[1] == '^');
+        close = *p == '[' && *first != '\0' ? (const unsigned char *) strchr((const char *) first + 1, ']') : NULL;
+
+        if(*p == '*') {
+            op.kind = GLOB_STAR;
+            while(*p == '*') {
+                p++;
+            }
+        } else if(*p == '?') {
+            op.kind = GLOB_ANY;
+            p++;
+        } else if(close != NULL) {
+            op.kind = GLOB_CLASS;
+            memset(op.set, 0, sizeof(op.set));
+
+            for(const unsigned char *c = first; c < close; c++) {
+                unsigned char low = *c, high = *c;
+                if(c[1] == '-' && c + 2 < close) {
+                    high = c[2];
+                    c += 2;
+                }
+                for(unsigned int ch = low; ch <= high; ch++) {
+                    op.set[ch / 64] |= 1ULL << (ch % 64);
+                }
+            }
+
+            if(first != p + 1) {
+                for(int i = 0; i < 4; i++) {
+                    op.set[i] = ~op.set[i];
+                }
+            }
+            p = close + 1;
+        } else {
+            if(*p == '\\' && p[1] != '\0') {
+                p++;
+            }
+            op.text.push_back(*p++);
+        }
+
+        // Runs of literal characters are compared in one go
+        if(op.kind == GLOB_LITERAL && !glob->ops.empty() && glob->ops.back().kind == GLOB_LITERAL) {
+            glob->ops.back().text += op.text;
         } else {
-            // Otherwise, the entry is a file. Check its size.
-            if(file_stat.st_size == 0) {
-                // Delete if it's empty
-                if(remove(fq_path) != 0) {
-                    fprintf(stderr, "%s%s%s\n", "prunedir: cannot delete '", fq_path, "'\n");
+            glob->ops.push_back(op);
+        }
+    }
+
+    // Most patterns are text with a star at one or both ends, which need
+    // nothing more than a comparison
+    vector<glob_op> &ops = glob->ops;
+    size_t n = ops.size();
+    glob->shape = GLOB_GENERAL;
+    glob->literal.clear();
+
+    if(n == 0 || (n == 1 && ops[0].kind == GLOB_LITERAL)) {
+        glob->shape = GLOB_EXACT;
+    } else if(n == 1 && ops[0].kind == GLOB_STAR) {
+        glob->shape = GLOB_SUFFIX;
+    } else if(n == 2 && ops[0].kind == GLOB_LITERAL && ops[1].kind == GLOB_STAR) {
+        glob->shape = GLOB_PREFIX;
+    } else if(n == 2 && ops[0].kind == GLOB_STAR && ops[1].kind == GLOB_LITERAL) {
+        glob->shape = GLOB_SUFFIX;
+    } else if(n == 3 && ops[0].kind == GLOB_STAR && ops[1].kind == GLOB_LITERAL && ops[2].kind == GLOB_STAR) {
+        glob->shape = GLOB_CONTAINS;
+    }
+
+    for(iterator = ops.begin(); glob->shape != GLOB_GENERAL && iterator != ops.end(); iterator++) {
+        glob->literal += iterator->text;
+    }
+}
+
+/*
+ * glob_match - whether name matches a compiled glob. A star first matches
+ * nothing; on a mismatch, the last star seen takes one more character and
+ * the steps after it are tried again from there.
+ */
+bool glob_match(struct glob_pattern *glob, const char *name) {
+    size_t len, lit_len = glob->literal.size();
+    size_t op = 0, pos = 0, star_op = 0, star_pos = 0;
+    size_t nops = glob->ops.size();
+    bool starred = false;
+
+    switch(glob->shape) {
+        case GLOB_EXACT:
+            return !strcmp(name, glob->literal.c_str());
+        case GLOB_PREFIX:
+            return !strncmp(name, glob->literal.c_str(), lit_len);
+        case GLOB_SUFFIX:
+            len = strlen(name);
+            return len >= lit_len && !memcmp(name + len - lit_len, glob->literal.c_str(), lit_len);
+        case GLOB_CONTAINS:
+            return strstr(name, glob->literal.c_str()) != NULL;
+    }
+
+    len = strlen(name);
+    while(true) {
+        if(op < nops) {
+            if(glob->ops[op].kind == GLOB_STAR) {
+                starred = true;
+                star_op = ++op;
+                star_pos = pos;
+                continue;
+            }
+            if(glob_op_match(&glob->ops[op], name, &pos)) {
+                op++;
+                continue;
+            }
+        } else if(pos == len) {
+            return true;
+        }
+
+        if(!starred || star_pos >= len) {
+            return false;
+        }
+        op = star_op;
+        pos = ++star_pos;
+    }
+}
+
+/*
+ * glob_op_match - match one step other than a star at name[*pos], moving
+ * *pos past what it matched
+ */
+bool glob_op_match(struct glob_op *op, const char *name, size_t *pos) {
+    unsigned char ch = name[*pos];
+
+    if(op->kind == GLOB_LITERAL) {
+        if(strncmp(name + *pos, op->text.c_str(), op->text.size()) != 0) {
+            return false;
+        }
+        *pos += op->text.size();
+        return true;
+    }
+
+    if(ch == '\0' || (op->kind == GLOB_CLASS && !(op->set[ch / 64] & (1ULL << (ch % 64))))) {
+        return false;
+    }
+    (*pos)++;
+    return true;
+}
+
+/*
+ * stat_ring_get - this thread's io_uring for statx, or NULL if io_uring
+ * can't be used here
+ */
+struct stat_ring *stat_ring_get() {
+    thread_local struct stat_ring ring;
+
+    if(ring.fd < 0 && !ring.failed && !stat_ring_setup(&ring)) {
+        ring.failed = true;
+    }
+
+    return ring.failed ? NULL : &ring;
+}
+
+/*
+ * stat_ring_setup - create an io_uring and map its submission and
+ * completion rings
+ */
+bool stat_ring_setup(struct stat_ring *ring) {
+    struct io_uring_params params;
+    char *sq, *cq;
+    void *sqes;
+
+    memset(&params, 0, sizeof(params));
+    if((ring->fd = syscall(__NR_io_uring_setup, STAT_RING_ENTRIES, &params)) < 0) {
+        return false;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Newer kernels share one mapping between both rings
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_len = ring->cq_len = max(ring->sq_len, ring->cq_len);
+    }
+
+    sq = (char *) mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(sq == MAP_FAILED) {
+        return false;
+    }
+    ring->sq_ptr = sq;
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else if((cq = (char *) mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+        return false;
+    }
+    ring->cq_ptr = cq;
+
+    sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) {
+        return false;
+    }
+    ring->sqes = (struct io_uring_sqe *) sqes;
+
+    ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    return true;
+}
+
+/*
+ * ~stat_ring - unmap and close a thread's ring when the thread exits
+ */
+stat_ring::~stat_ring() {
+    if(sqes != NULL) {
+        munmap(sqes, sqes_len);
+    }
+    if(cq_ptr != NULL && cq_ptr != sq_ptr) {
+        munmap(cq_ptr, cq_len);
+    }
+    if(sq_ptr != NULL) {
+        munmap(sq_ptr, sq_len);
+    }
+    if(fd >= 0) {
+        close(fd);
+    }
+}
+
+/*
+ * stat_ring_statx - statx the wanted entries relative to dir_fd through this
+ * thread's io_uring, a ring's worth of submissions per system call. Returns
+ * false if the caller should stat them itself instead.
+ */
+bool stat_ring_statx(int dir_fd, vector<fs_elem> *elems, vector<size_t> *wanted, vector<struct statx> *stats, unsigned int mask) {
+    struct stat_ring *ring;
+    size_t next = 0;
+
+    // A handful of entries isn't worth the trip
+    if(wanted->size() < STAT_RING_MIN || (ring = stat_ring_get()) == NULL) {
+        return false;
+    }
+
+    while(next < wanted->size()) {
+        unsigned int count = min((size_t) ring->entries, wanted->size() - next);
+        unsigned int tail = *ring->sq_tail;
+        unsigned int head, submitted;
+
+        for(unsigned int i = 0; i < count; i++) {
+            size_t index = (*wanted)[next + i];
+            unsigned int slot = tail & *ring->sq_mask;
+            struct io_uring_sqe *sqe = &ring->sqes[slot];
+
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dir_fd;
+            sqe->addr = (unsigned long) (*elems)[index].name.c_str();
+            sqe->len = mask;
+            sqe->off = (unsigned long) &(*stats)[index];
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+            sqe->user_data = index;
+
+            ring->sq_array[slot] = slot;
+            tail++;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        // Submit the lot, then wait for every one of them to complete
+        submitted = 0;
+        head = *ring->cq_head;
+        for(unsigned int done = 0; done < count; ) {
+            if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+                long ret = syscall(__NR_io_uring_enter, ring->fd, count - submitted, count - done, IORING_ENTER_GETEVENTS, NULL, 0);
+                if(ret > 0) {
+                    submitted += ret;
+                } else if(ret < 0 && errno != EINTR && submitted == 0) {
+                    ring->failed = true;
+                    return false;
                 }
+                continue;
+            }
+
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            struct statx *file_stat = &(*stats)[cqe->user_data];
+
+            // A kernel without IORING_OP_STATX rejects the opcode itself
+            if(cqe->res == -EINVAL) {
+                ring->failed = true;
             }
+            if(cqe->res < 0) {
+                memset(file_stat, 0, sizeof(struct statx));
+                file_stat->stx_mode = S_IFREG;
+            }
+
+            head++;
+            done++;
         }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        if(ring->failed) {
+            return false;
+        }
+        next += count;
     }
-    
-    // Close the directory
-    closedir(directory);
+
+    return true;
+}
+
+/*
+ * walk_threads - the number of threads to use for a parallel walk
+ */
+int walk_threads() {
+    unsigned int n = std::thread::hardware_concurrency();
+
+    return n > 0 ? n : 4;
+}
+
+/*
+ * parse_threads - read the -j option at argv[*i] for any builtin that walks
+ * in parallel. The count is given as -jN or -j N; a bare -j, or -j 0, means
+ * one thread per core. *i is moved past a separate count.
+ */
+int parse_threads(const char *builtin, char *argv[], int *i, int *threads) {
+    char *count = argv[*i][2] != '\0' ? &argv[*i][2] : argv[*i + 1];
+
+    if(count != NULL && count[0] >= '0' && count[0] <= '9') {
+        *threads = atoi(count);
+        if(count == argv[*i + 1]) {
+            (*i)++;
+        }
+    } else if(count == &argv[*i][2]) {
+        fprintf(stderr, "%s%s%s%s\n", builtin, ": invalid thread count -- '", count, "'");
+        return 1;
+    } else {
+        *threads = 0;
+    }
+
+    if(*threads <= 0) {
+        *threads = walk_threads();
+    }
+
     return 0;
 }
 
+/*
+ * walk_start - start nthreads workers on a parallel walk of the root
+ * directories. The roots are dealt out round-robin; from then on each worker
+ * pushes and pops the back of its own deque and, once that is empty, steals
+ * from the front of the others'.
+ */
+void walk_start(struct walk_ctx *ctx, list<walk_dir *> *roots, int nthreads) {
+    list<walk_dir *>::iterator iterator;
+    sigset_t all_signals, old_signals;
+    int n = 0;
+
+    ctx->outstanding = roots->size();
+    ctx->queued = roots->size();
+    ctx->sleepers = 0;
+
+    // Leaving bottom-up walks back up through the parents
+    if(ctx->leave != NULL || ctx->keep_fds) {
+        ctx->keep_parents = true;
+    }
+
+    for(int i = 0; i < nthreads; i++) {
+        walk_worker *worker = new walk_worker();
+        worker->ctx = ctx;
+        worker->id = i;
+        ctx->workers.push_back(worker);
+    }
+
+    for(iterator = roots->begin(); iterator != roots->end(); iterator++) {
+        (*iterator)->parent = NULL;
+        (*iterator)->depth = 0;
+        (*iterator)->fd = -1;
+        (*iterator)->fd_refs = 1;
+        (*iterator)->pending = 1;
+        (*iterator)->count = 0;
+        ctx->workers[n++ % nthreads]->tasks.push_back(*iterator);
+    }
+
+    // Workers start with every signal blocked, so the shell's handlers
+    // only ever run on the main thread
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+    for(int i = 0; i < nthreads; i++) {
+        ctx->threads.push_back(std::thread(walk_thread, ctx->workers[i]));
+    }
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+}
+
+/*
+ * walk_finish - wait for the workers of a walk to run out of work and exit
+ */
+void walk_finish(struct walk_ctx *ctx) {
+    // Every thread must be gone before any deque it might steal from is freed
+    for(size_t i = 0; i < ctx->threads.size(); i++) {
+        ctx->threads[i].join();
+    }
+    for(size_t i = 0; i < ctx->workers.size(); i++) {
+        delete ctx->workers[i];
+    }
+
+    ctx->threads.clear();
+    ctx->workers.clear();
+}
+
+/*
+ * walk_push - queue the subdirectory name of parent on this worker's deque
+ */
+void walk_push(struct walk_worker *worker, struct walk_dir *parent, const char *name, void *data) {
+    struct walk_ctx *ctx = worker->ctx;
+    walk_dir *dir = new walk_dir();
+
+    dir->parent = parent;
+    dir->name = name;
+    dir->depth = parent->depth + 1;
+    dir->fd = -1;
+    dir->fd_refs = 1;
+    dir->pending = 1;
+    dir->count = 0;
+    dir->data = data;
+
+    // The child is opened relative to the parent, so hold the parent's fd,
+    // and the parent's subtree isn't done until the child's is
+    parent->fd_refs++;
+    parent->pending++;
+    ctx->outstanding++;
+
+    {
+        lock_guard<mutex> guard(worker->lock);
+        worker->tasks.push_back(dir);
+    }
+    ctx->queued++;
+
+    // Wake an idle worker to come and steal it
+    if(ctx->sleepers > 0) {
+        lock_guard<mutex> guard(ctx->idle_lock);
+        ctx->idle_cv.notify_one();
+    }
+}
+
+/*
+ * walk_next - take the next directory for a worker: the newest of its own, or
+ * else the oldest of another worker's, which is the nearest the root and so
+ * likely the biggest subtree
+ */
+struct walk_dir *walk_next(struct walk_worker *worker) {
+    struct walk_ctx *ctx = worker->ctx;
+    size_t nworkers = ctx->workers.size();
+    walk_dir *dir = NULL;
+
+    {
+        lock_guard<mutex> guard(worker->lock);
+        if(!worker->tasks.empty()) {
+            dir = worker->tasks.back();
+            worker->tasks.pop_back();
+        }
+    }
+
+    for(size_t i = 1; dir == NULL && i < nworkers; i++) {
+        walk_worker *victim = ctx->workers[(worker->id + i) % nworkers];
+        lock_guard<mutex> guard(victim->lock);
+        if(!victim->tasks.empty()) {
+            dir = victim->tasks.front();
+            victim->tasks.pop_front();
+        }
+    }
+
+    if(dir != NULL) {
+        ctx->queued--;
+    }
+    return dir;
+}
+
+/*
+ * walk_thread - the body of a worker: open and visit directories until the
+ * whole walk is done
+ */
+void walk_thread(struct walk_worker *worker) {
+    struct walk_ctx *ctx = worker->ctx;
+    walk_dir *dir;
+
+    while(true) {
+        if((dir = walk_next(worker)) == NULL) {
+            // Nothing to take, so sleep until more is queued or the walk is over
+            unique_lock<mutex> guard(ctx->idle_lock);
+            ctx->sleepers++;
+            while(ctx->queued == 0 && ctx->outstanding > 0) {
+                ctx->idle_cv.wait(guard);
+            }
+            ctx->sleepers--;
+
+            if(ctx->outstanding == 0) {
+                return;
+            }
+            continue;
+        }
+
+        // Once cancelled, the rest of the walk is drained without opening anything
+        if(builtin_cancelled) {
+            dir->fd = -1;
+            errno = ECANCELED;
+        } else if(dir->parent != NULL) {
+            dir->fd = openat(dir->parent->fd, dir->name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        } else {
+            dir->fd = open(dir->name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        dir->error = dir->fd < 0 ? errno : 0;
+
+        // Kept parents outlive their children, so the pointer stays to
+        // report the child's completion to and to build its path from
+        if(dir->parent != NULL) {
+            walk_release(ctx, dir->parent);
+            if(!ctx->keep_parents) {
+                dir->parent = NULL;
+            }
+        }
+
+        ctx->visit(worker, dir);
+        if(!ctx->keep_fds) {
+            walk_release(ctx, dir);
+        }
+        if(ctx->keep_parents) {
+            walk_complete(worker, dir);
+        }
+
+        if(--ctx->outstanding == 0) {
+            lock_guard<mutex> guard(ctx->idle_lock);
+            ctx->idle_cv.notify_all();
+        }
+    }
+}
+
+/*
+ * walk_release - drop a reference to a directory's fd, closing it once its
+ * visit is over and every child has been opened. Unless the walk keeps
+ * parents, the directory is freed then too.
+ */
+void walk_release(struct walk_ctx *ctx, struct walk_dir *dir) {
+    if(--dir->fd_refs == 0) {
+        if(dir->fd >= 0) {
+            close(dir->fd);
+        }
+        if(ctx->keep_parents) {
+            dir->fd = -1;
+        } else {
+            delete dir;
+        }
+    }
+}
+
+/*
+ * walk_complete - count one more part of a directory's subtree as done. The
+ * last part to finish calls any leave callback, lets the directory go and
+ * passes the completion on to its parent, so directories are left bottom-up.
+ */
+void walk_complete(struct walk_worker *worker, struct walk_dir *dir) {
+    struct walk_ctx *ctx = worker->ctx;
+    walk_dir *parent;
+
+    while(dir != NULL && --dir->pending == 0) {
+        if(ctx->leave != NULL) {
+            ctx->leave(worker, dir);
+        }
+        parent = dir->parent;
+
+        // Only with keep_fds is the fd still open by now
+        if(dir->fd >= 0) {
+            close(dir->fd);
+        }
+        delete dir;
+        dir = parent;
+    }
+}
+
+/*
+ * walk_path - the path of a directory on the walk, ending in a slash, from
+ * its root down. Only a walk with keep_parents set keeps the parents this
+ * needs; on any other the path starts at the directory itself.
+ */
+void walk_path(struct walk_dir *dir, string *path) {
+    vector<walk_dir *> chain;
+    vector<walk_dir *>::reverse_iterator iterator;
+
+    for(; dir != NULL; dir = dir->parent) {
+        chain.push_back(dir);
+    }
+
+    path->clear();
+    for(iterator = chain.rbegin(); iterator != chain.rend(); iterator++) {
+        path->append((*iterator)->name);
+        if((*path)[path->size() - 1] != '/') {
+            path->append("/");
+        }
+    }
+}
+
+/*
+ * inode_set_insert - add (dev, ino) to the set, returning false if it was
+ * already there
+ */
+bool inode_set_insert(struct inode_set *set, dev_t dev, ino_t ino) {
+    dev_ino key = { dev, ino };
+    size_t shard = dev_ino_hash()(key) % INODE_SET_SHARDS;
+
+    lock_guard<mutex> guard(set->locks[shard]);
+    return set->shards[shard].insert(key).second;
+}
+
+/*
+ * dent_open - prepare to read the entries of the directory fd into buf
+ */
+void dent_open(struct dent_reader *reader, int fd, char *buf, size_t len) {
+    reader->fd = fd;
+    reader->buf = buf;
+    reader->len = len;
+    reader->nread = 0;
+    reader->pos = 0;
+}
+
+/*
+ * dent_next - return the next entry of a directory other than . and .., or
+ * NULL once there are no more
+ */
+struct dirent64 *dent_next(struct dent_reader *reader) {
+    struct dirent64 *entry;
+
+    do {
+        // Refill the buffer once every entry in it has been returned
+        if(reader->pos >= reader->nread) {
+            reader->nread = getdents64(reader->fd, reader->buf, reader->len);
+            reader->pos = 0;
+            if(reader->nread <= 0) {
+                return NULL;
+            }
+        }
+
+        entry = (struct dirent64 *) (reader->buf + reader->pos);
+        reader->pos += entry->d_reclen;
+    } while(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."));
+
+    return entry;
+}
+
+/*
+ * dent_buffered - whether entries are left in the buffer, so that the next
+ * dent_next will not need another getdents64
+ */
+bool dent_buffered(struct dent_reader *reader) {
+    return reader->pos < reader->nread;
+}
+
 /*
  * print_signal_table - print the number of times a signal was received and subsequently handled
  */